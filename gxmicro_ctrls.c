@@ -7,32 +7,103 @@
  * Author:
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
+#include <linux/math64.h>
+
 #include "gxmicro_jpeg.h"
+#include "gxmicro_trace.h"
+
+/* JPEG_ENC_QP 在 gxmicro_jpeg_start() 中每帧写入 */
+static inline void gxmicro_jpeg_set_qp(struct gxmicro_jpeg_dev *gdev, uint32_t val)
+{
+	WRITE_ONCE(gdev->qp, val);
+}
 
 static inline void gxmicro_jpeg_set_quality(struct gxmicro_jpeg_dev *gdev, uint32_t val)
 {
-	gxmicro_write(gdev, JPEG_ENC_QP, val);
+	gdev->quality = val;
+	gxmicro_format_update(gdev);	/* sizeimage */
+
+	/* CBR: QP 由码率控制调整 */
+	if (!READ_ONCE(gdev->rc.enable))
+		gxmicro_jpeg_set_qp(gdev, val);
 }
 
-static void gxmicro_jpeg_set_subsampling(struct gxmicro_jpeg_dev *gdev, uint32_t val)
+/* JPEG_BS_FORMAT 在 gxmicro_jpeg_start() 中每帧写入 */
+static inline void gxmicro_jpeg_set_subsampling(struct gxmicro_jpeg_dev *gdev, uint32_t val)
+{
+	WRITE_ONCE(gdev->subsampling, val);
+	gxmicro_format_update(gdev);
+}
+
+/* ****************************** Rate Control ****************************** */
+
+static void gxmicro_rc_set_mode(struct gxmicro_jpeg_dev *gdev, uint32_t val)
 {
-	uint32_t jconf = 0;
+	bool enable = val == V4L2_MPEG_VIDEO_BITRATE_MODE_CBR;
+
+	WRITE_ONCE(gdev->rc.enable, enable);
+
+	/* CQ: 恢复 V4L2_CID_JPEG_COMPRESSION_QUALITY; CBR: 从当前 QP 开始调整 */
+	if (!enable)
+		gxmicro_jpeg_set_qp(gdev, gdev->quality);
+}
+
+/* 每帧完成后, 下一次 JPEG_ENC_START 之前调用 */
+void gxmicro_rc_update(struct gxmicro_jpeg_dev *gdev, uint32_t fsize)
+{
+	struct gxmicro_rc *rc = &gdev->rc;
+	uint32_t target, qp;
+	int64_t delta;
+
+	if (!READ_ONCE(rc->enable))
+		return;
+
+	target = div_u64((uint64_t)READ_ONCE(rc->bitrate) * READ_ONCE(gdev->interval),
+			 BITS_PER_BYTE * NSEC_PER_SEC);
+	qp = READ_ONCE(gdev->qp);
+
+	/* 码流大小与 QP 近似成反比, 按相对误差比例调整, 单帧最多减半或加倍 */
+	delta = div_s64((int64_t)qp * ((int64_t)fsize - target) * READ_ONCE(rc->gain),
+			(int64_t)target * JPEG_RC_GAIN_DIV);
+	delta = clamp_t(int64_t, delta, -(int64_t)(qp / 2), qp);
+	if (!delta && fsize > target)
+		delta = 1;	/* 小 QP 时至少调整 1 */
 
-	jconf = gxmicro_read(gdev, JPEG_CONF);
-	jconf &= ~JPEG_BS_FORMAT_MASK;
+	qp = clamp_t(int64_t, qp + delta, JPEG_QP_MIN, JPEG_QP_MAX);
 
-	switch (val) {
-	case V4L2_JPEG_CHROMA_SUBSAMPLING_444:
-		jconf |= JEPG_BS_YUV444;
+	trace_gxmicro_jpeg_rc(fsize, target, qp);
+
+	if (qp != gdev->qp)
+		gxmicro_jpeg_set_qp(gdev, qp);
+}
+
+/* ****************************** Controls OPS ****************************** */
+
+static int gxmicro_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct gxmicro_jpeg_dev *gdev = container_of(ctrl->handler, struct gxmicro_jpeg_dev, hdl);
+
+	switch (ctrl->id) {
+	case V4L2_CID_GXMICRO_QP:
+		ctrl->val = READ_ONCE(gdev->qp);
+		break;
+	case V4L2_CID_GXMICRO_OVERFLOWS:
+		ctrl->val = READ_ONCE(gdev->stats.overflows);
 		break;
-	case V4L2_JPEG_CHROMA_SUBSAMPLING_420:
-		jconf |= JEPG_BS_YUV420;
+	case V4L2_CID_GXMICRO_RETRIES:
+		ctrl->val = READ_ONCE(gdev->stats.retries);
 		break;
+	case V4L2_CID_GXMICRO_SKIPS:
+		ctrl->val = READ_ONCE(gdev->stats.skips);
+		break;
+	case V4L2_CID_GXMICRO_DUPS:
+		ctrl->val = READ_ONCE(gdev->stats.dups);
+		break;
+	default:
+		return -EINVAL;
 	}
 
-	gdev->subsampling = val;
-
-	gxmicro_write(gdev, JPEG_CONF, jconf);
+	return 0;
 }
 
 static int gxmicro_s_ctrl(struct v4l2_ctrl *ctrl)
@@ -46,6 +117,30 @@ static int gxmicro_s_ctrl(struct v4l2_ctrl *ctrl)
 	case V4L2_CID_JPEG_CHROMA_SUBSAMPLING:
 		gxmicro_jpeg_set_subsampling(gdev, ctrl->val);
 		break;
+	case V4L2_CID_MPEG_VIDEO_BITRATE_MODE:
+		gxmicro_rc_set_mode(gdev, ctrl->val);
+		break;
+	case V4L2_CID_MPEG_VIDEO_BITRATE:
+		WRITE_ONCE(gdev->rc.bitrate, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_RC_GAIN:
+		WRITE_ONCE(gdev->rc.gain, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_LOW_LATENCY:
+		gxmicro_vb2_set_low_latency(gdev, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_SKIP_UNCHANGED:
+		WRITE_ONCE(gdev->tile.enable, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_DUP_MODE:
+		WRITE_ONCE(gdev->dup.mode, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_DUP_KEEPALIVE:
+		WRITE_ONCE(gdev->dup.keepalive, ms_to_ktime(ctrl->val));
+		break;
+	case V4L2_CID_GXMICRO_META_TILES:
+		WRITE_ONCE(gdev->meta.tiles, ctrl->val);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -54,9 +149,143 @@ static int gxmicro_s_ctrl(struct v4l2_ctrl *ctrl)
 }
 
 static const struct v4l2_ctrl_ops gxmicro_ctrl_ops = {
+	.g_volatile_ctrl = gxmicro_g_volatile_ctrl,
 	.s_ctrl = gxmicro_s_ctrl,
 };
 
+static const struct v4l2_ctrl_config gxmicro_ctrl_rc_gain = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_RC_GAIN,
+	.name = "Rate Control Gain",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = JPEG_RC_GAIN_MIN,
+	.max = JPEG_RC_GAIN_MAX,
+	.step = 1,
+	.def = JPEG_RC_GAIN_DEF,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_qp = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_QP,
+	.name = "Encode QP",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = JPEG_QP_MIN,
+	.max = JPEG_QP_MAX,
+	.step = 1,
+	.def = JPEG_QP_DEF,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_low_latency = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_LOW_LATENCY,
+	.name = "Low Latency",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_skip_unchanged = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_SKIP_UNCHANGED,
+	.name = "Skip Unchanged Frames",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_skips = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_SKIPS,
+	.name = "Skipped Frames",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = 0,
+	.max = S32_MAX,
+	.step = 1,
+	.def = 0,
+};
+
+static const char * const gxmicro_dup_mode_menu[] = {
+	[GXMICRO_DUP_OFF] = "Off",
+	[GXMICRO_DUP_FLAG] = "Flag",
+	[GXMICRO_DUP_DROP] = "Drop",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_dup_mode = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_DUP_MODE,
+	.name = "Duplicate Frames",
+	.type = V4L2_CTRL_TYPE_MENU,
+	.min = GXMICRO_DUP_OFF,
+	.max = GXMICRO_DUP_DROP,
+	.def = GXMICRO_DUP_OFF,
+	.qmenu = gxmicro_dup_mode_menu,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_dup_keepalive = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_DUP_KEEPALIVE,
+	.name = "Duplicate Keep-alive (ms)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = JPEG_DUP_KEEPALIVE_MAX,
+	.step = 1,
+	.def = JPEG_DUP_KEEPALIVE_DEF,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_dups = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_DUPS,
+	.name = "Dropped Duplicates",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = 0,
+	.max = S32_MAX,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_meta_tiles = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_META_TILES,
+	.name = "Metadata Dirty Tiles",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 1,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_overflows = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_OVERFLOWS,
+	.name = "Bitstream Overflows",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = 0,
+	.max = S32_MAX,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config gxmicro_ctrl_retries = {
+	.ops = &gxmicro_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_RETRIES,
+	.name = "Overflow Retries",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min = 0,
+	.max = S32_MAX,
+	.step = 1,
+	.def = 0,
+};
+
 int gxmicro_ctrls_init(struct gxmicro_jpeg_dev *gdev)
 {
 	struct device *dev = gdev->dev;
@@ -64,7 +293,7 @@ int gxmicro_ctrls_init(struct gxmicro_jpeg_dev *gdev)
 	struct v4l2_ctrl_handler *hdl = &gdev->hdl;
 	int ret;
 
-	ret = v4l2_ctrl_handler_init(hdl, 2);
+	ret = v4l2_ctrl_handler_init(hdl, 15);
 	if (ret) {
 		dev_err(dev, "Failed to init Control Handler\n");
 		return ret;
@@ -76,6 +305,26 @@ int gxmicro_ctrls_init(struct gxmicro_jpeg_dev *gdev)
 	v4l2_ctrl_new_std_menu(hdl, &gxmicro_ctrl_ops, V4L2_CID_JPEG_CHROMA_SUBSAMPLING,
 			V4L2_JPEG_CHROMA_SUBSAMPLING_420, JPEG_CHROMA_SUBSAMPLING_MASK, V4L2_JPEG_CHROMA_SUBSAMPLING_444);
 
+	/* 码率控制: CQ 使用固定 QP, CBR 根据 JPEG_BS_LENGTH 逐帧调整 QP */
+	v4l2_ctrl_new_std_menu(hdl, &gxmicro_ctrl_ops, V4L2_CID_MPEG_VIDEO_BITRATE_MODE,
+			V4L2_MPEG_VIDEO_BITRATE_MODE_CQ, BIT(V4L2_MPEG_VIDEO_BITRATE_MODE_VBR),
+			V4L2_MPEG_VIDEO_BITRATE_MODE_CQ);
+
+	v4l2_ctrl_new_std(hdl, &gxmicro_ctrl_ops, V4L2_CID_MPEG_VIDEO_BITRATE,
+			JPEG_RC_BITRATE_MIN, JPEG_RC_BITRATE_MAX, 1, JPEG_RC_BITRATE_DEF);
+
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_rc_gain, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_qp, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_low_latency, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_skip_unchanged, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_dup_mode, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_dup_keepalive, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_meta_tiles, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_overflows, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_retries, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_skips, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_ctrl_dups, NULL);
+
 	ret = hdl->error;
 	if (ret) {
 		dev_err(dev, "Failed to add Controls\n");
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro JPEG debugfs
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "gxmicro_jpeg.h"
+
+/*
+ * /sys/kernel/debug/<dev_name>/stats: 实时采集的累计统计, 写入任意内容清零.
+ * 计数在已持有 buf_lock 的路径中累加, 读取时复制一份后格式化.
+ */
+
+static void gxmicro_hist_show(struct seq_file *s, const char *name, const struct gxmicro_hist *hist)
+{
+	int i;
+
+	seq_printf(s, "\n%s (us):\n", name);
+	for (i = 0; i < JPEG_HIST_BUCKETS - 1; i++)
+		seq_printf(s, "  [%7u, %7u) %llu\n", i ? 1U << i : 0, 2U << i, hist->count[i]);
+	seq_printf(s, "  [%7u,    inf) %llu\n", 1U << i, hist->count[i]);
+}
+
+static int gxmicro_stats_show(struct seq_file *s, void *data)
+{
+	struct gxmicro_jpeg_dev *gdev = s->private;
+	struct gxmicro_debug debug;
+	unsigned long flags;
+	uint64_t ratio = 0;
+	uint32_t raw;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	debug = gdev->debug;
+	/* 按当前格式计算, 统计期间分辨率变化时为近似值 */
+	raw = JPEG_SZ(gdev->fmt.height, gdev->fmt.bpl);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	if (debug.bytes)
+		ratio = div64_u64((uint64_t)raw * debug.frames * 100, debug.bytes);
+
+	seq_printf(s, "encoded:     %llu\n", debug.encoded);
+	seq_printf(s, "frames:      %llu\n", debug.frames);
+	seq_printf(s, "errors:      %llu\n", debug.errors);
+	seq_printf(s, "dropped:     %llu\n", debug.drops);
+	seq_printf(s, "overflows:   %llu\n", debug.overflows);
+	seq_printf(s, "bytes:       %llu\n", debug.bytes);
+	seq_printf(s, "avg bytes:   %llu\n", debug.frames ? div64_u64(debug.bytes, debug.frames) : 0);
+	seq_printf(s, "raw bytes:   %u\n", raw);
+	seq_printf(s, "ratio:       %llu.%02llu\n", div_u64(ratio, 100), ratio % 100);
+	seq_printf(s, "qp:          %u\n", READ_ONCE(gdev->qp));
+	seq_printf(s, "subsampling: %s\n",
+		   READ_ONCE(gdev->subsampling) == V4L2_JPEG_CHROMA_SUBSAMPLING_420 ? "4:2:0" : "4:4:4");
+
+	gxmicro_hist_show(s, "encode", &debug.encode);
+	gxmicro_hist_show(s, "irq to done", &debug.done);
+	gxmicro_hist_show(s, "tile hash", &debug.hash);
+
+	return 0;
+}
+
+static int gxmicro_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gxmicro_stats_show, inode->i_private);
+}
+
+static ssize_t gxmicro_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct gxmicro_jpeg_dev *gdev = file_inode(file)->i_private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	memset(&gdev->debug, 0, sizeof(gdev->debug));
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations gxmicro_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = gxmicro_stats_open,
+	.read = seq_read,
+	.write = gxmicro_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void gxmicro_debugfs_init(struct gxmicro_jpeg_dev *gdev)
+{
+	gdev->debugfs = debugfs_create_dir(dev_name(gdev->dev), NULL);
+	debugfs_create_file("stats", 0644, gdev->debugfs, gdev, &gxmicro_stats_fops);
+}
+
+void gxmicro_debugfs_fini(struct gxmicro_jpeg_dev *gdev)
+{
+	debugfs_remove_recursive(gdev->debugfs);
+	gdev->debugfs = NULL;
+}
@@ -8,6 +8,10 @@
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
 #include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/of_reserved_mem.h>
+#include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-v4l2.h>
 
 #include "gxmicro_jpeg.h"
 
@@ -16,19 +20,77 @@
 static int gxmicro_plat_init(struct gxmicro_jpeg_dev *gdev)
 {
 	struct platform_device *pdev = to_platform_device(gdev->dev);
+	int ret;
+
+	/* JPEG_BS_BASE 为 32 bit, DMABUF / USERPTR 导入的 buffer 也必须满足 */
+	ret = dma_set_mask_and_coherent(gdev->dev, DMA_BIT_MASK(32));
+	if (ret) {
+		dev_err(gdev->dev, "Failed to set DMA mask\n");
+		return ret;
+	}
+
+	/* 导入 DMABUF 时按单个连续段映射 */
+	ret = vb2_dma_contig_set_max_seg_size(gdev->dev, DMA_BIT_MASK(32));
+	if (ret)
+		return ret;
+
+	gdev->pdata = dev_get_platdata(gdev->dev);
+	if (IS_ENABLED(CONFIG_VIDEO_GXMICRO_EMU) && gdev->pdata)
+		return 0;	/* 模拟引擎, 无 MMIO */
 
 	gdev->mem = devm_platform_ioremap_resource(pdev, 0);
 	if (IS_ERR(gdev->mem))
 		return PTR_ERR(gdev->mem);
 
-	/* Reserved: clk ? mem reserved ? dma ? */
+	/*
+	 * memory-region (shared-dma-pool): vb2 dma-contig 与快照 buffer 从该设备的专用内存池分配.
+	 * no-map 区域由 bitmap 分配, 不经过 CMA 迁移, 重新 REQBUFS 不受系统内存碎片影响.
+	 * 区域大小至少为 JPEG_BUFFERS 个最大分辨率 sizeimage 与快照 buffer 之和, m2m 原始图像也从中分配.
+	 * 非一致性 (V4L2_MEMORY_FLAG_NON_COHERENT) buffer 不能从该内存池分配, 有内存池时不启用, 见 gxmicro_vb2_cache_hints().
+	 */
+	ret = of_reserved_mem_device_init(gdev->dev);
+	if (ret && ret != -ENODEV) {
+		dev_err(gdev->dev, "Failed to init reserved memory\n");
+		return ret;
+	}
+	gdev->mem_reserved = !ret;
+
+	/* Reserved: clk ? */
 
 	return 0;
 }
 
 static void gxmicro_plat_fini(struct gxmicro_jpeg_dev *gdev)
 {
+	if (gdev->mem_reserved)
+		of_reserved_mem_device_release(gdev->dev);
+}
+
+/* ****************************** Media ****************************** */
+
+/* Request API: 非 m2m 设备, request 中的 buffer 直接进入 vb2 队列 */
+static const struct media_device_ops gxmicro_media_ops = {
+	.req_validate = vb2_request_validate,
+	.req_queue = vb2_request_queue,
+};
+
+static void gxmicro_media_init(struct gxmicro_jpeg_dev *gdev)
+{
+	struct media_device *mdev = &gdev->mdev;
+
+	mdev->dev = gdev->dev;
+	strscpy(mdev->model, DRVNAME, sizeof(mdev->model));
+	snprintf(mdev->bus_info, sizeof(mdev->bus_info), "platform:%s", dev_name(gdev->dev));
+	mdev->ops = &gxmicro_media_ops;
 
+	media_device_init(mdev);
+
+	gdev->v4l2.mdev = mdev;
+}
+
+static void gxmicro_media_fini(struct gxmicro_jpeg_dev *gdev)
+{
+	media_device_cleanup(&gdev->mdev);
 }
 
 /* ****************************** V4L2 ****************************** */
@@ -40,11 +102,15 @@ static int gxmicro_v4l2_init(struct gxmicro_jpeg_dev *gdev)
 	mutex_init(&gdev->vlock);
 	spin_lock_init(&gdev->buf_lock);
 	INIT_LIST_HEAD(&gdev->buffers);
+	INIT_LIST_HEAD(&gdev->done);
+	gxmicro_fanout_init(gdev);
+
+	gxmicro_media_init(gdev);
 
 	ret = v4l2_device_register(gdev->dev, &gdev->v4l2);
 	if (ret) {
 		dev_err(gdev->dev, "Failed to register V4L2 device\n");
-		return ret;
+		goto err_v4l2_register;
 	}
 
 	ret = gxmicro_ctrls_init(gdev);
@@ -59,19 +125,48 @@ static int gxmicro_v4l2_init(struct gxmicro_jpeg_dev *gdev)
 	if (ret)
 		goto err_video_init;
 
+	ret = gxmicro_meta_init(gdev);
+	if (ret)
+		goto err_meta_init;
+
+	ret = gxmicro_m2m_init(gdev);
+	if (ret)
+		goto err_m2m_init;
+
+	/* video 节点注册后再注册 media device */
+	ret = media_device_register(&gdev->mdev);
+	if (ret) {
+		dev_err(gdev->dev, "Failed to register Media device\n");
+		goto err_media_register;
+	}
+
 	return 0;
 
+err_media_register:
+	gxmicro_m2m_fini(gdev);
+err_m2m_init:
+	gxmicro_meta_fini(gdev);
+err_meta_init:
+	gxmicro_video_fini(gdev);
 err_video_init:
 	gxmicro_vb2_fini(gdev);
 err_vb2_init:
 	gxmicro_ctrls_fini(gdev);
 err_ctrls_init:
 	v4l2_device_unregister(&gdev->v4l2);
+err_v4l2_register:
+	gxmicro_media_fini(gdev);
 	return ret;
 }
 
 static void gxmicro_v4l2_fini(struct gxmicro_jpeg_dev *gdev)
 {
+	media_device_unregister(&gdev->mdev);
+
+	gxmicro_m2m_fini(gdev);
+
+	gxmicro_meta_fini(gdev);
+
 	gxmicro_video_fini(gdev);
 
 	gxmicro_vb2_fini(gdev);
@@ -79,6 +174,10 @@ static void gxmicro_v4l2_fini(struct gxmicro_jpeg_dev *gdev)
 	gxmicro_ctrls_fini(gdev);
 
 	v4l2_device_unregister(&gdev->v4l2);
+
+	gxmicro_media_fini(gdev);
+
+	gxmicro_fanout_fini(gdev);
 }
 
 /* ****************************** Platform Probe & Remove ****************************** */
@@ -103,11 +202,14 @@ static int gxmicro_jpeg_probe(struct platform_device *pdev)
 	if (ret)
 		goto err_v4l2_init;
 
+	gxmicro_debugfs_init(gdev);
+
 	/* Reserved */
 
 	return 0;
 
 err_v4l2_init:
+	gxmicro_plat_fini(gdev);
 err_plat_init:
 	return ret;
 }
@@ -118,6 +220,8 @@ static int gxmicro_jpeg_remove(struct platform_device *pdev)
 
 	/* Reserved */
 
+	gxmicro_debugfs_fini(gdev);
+
 	gxmicro_v4l2_fini(gdev);
 
 	gxmicro_plat_fini(gdev);
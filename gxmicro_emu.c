@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro JPEG Emulated Engine
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/module.h>
+#include <linux/bitfield.h>
+#include <linux/platform_device.h>
+#include <linux/dma-direct.h>
+#include <linux/dma-mapping.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/irqdomain.h>
+#include <linux/irq_sim.h>
+
+#include "gxmicro_jpeg.h"
+
+#define EMU_NAME		"gxmicro-jpeg-emu"
+#define EMU_VERSION		0x00010000
+#define EMU_REG(reg)		(((reg) - JPEG_BASE) >> 2)
+#define EMU_NR_REGS		(EMU_REG(JPEG_VERSION) + 1)
+
+static unsigned int width = JPEG_MAX_WIDTH;
+module_param(width, uint, 0444);
+MODULE_PARM_DESC(width, "JPEG_WIDTH of the emulated capture (default 1920)");
+
+static unsigned int height = JPEG_MAX_HEIGHT;
+module_param(height, uint, 0444);
+MODULE_PARM_DESC(height, "JPEG_HEIGHT of the emulated capture (default 1080)");
+
+static unsigned int encode_us = 10000;
+module_param(encode_us, uint, 0644);
+MODULE_PARM_DESC(encode_us, "Time from JPEG_ENC_START to EOF in us (default 10000)");
+
+static unsigned int bs_size = 262144;
+module_param(bs_size, uint, 0644);
+MODULE_PARM_DESC(bs_size, "Bitstream size in bytes at the default QP, scaled by 128 / QP (default 262144)");
+
+static unsigned int fb_update_ms;
+module_param(fb_update_ms, uint, 0444);
+MODULE_PARM_DESC(fb_update_ms, "Move a 64x64 block in the JPEG_FB_BASE framebuffer every N ms, 0 for a static image (default 0)");
+
+struct gxmicro_emu {
+	struct platform_device *pdev;
+
+	spinlock_t lock;	/* regs lock */
+	uint32_t regs[EMU_NR_REGS];
+	bool busy;
+
+	struct hrtimer timer;	/* JPEG_ENC_START -> EOF */
+
+	uint32_t *fb;		/* JPEG_FB_BASE, XRGB8888 */
+	dma_addr_t fb_dma;
+	size_t fb_size;
+	uint32_t fb_pos;
+	struct delayed_work fb_work;
+
+	struct fwnode_handle *fwnode;
+	struct irq_domain *domain;
+	int irq;
+};
+
+static struct gxmicro_emu *gemu;
+
+/* ****************************** Bitstream ****************************** */
+
+/*
+ * 生成一帧可解码的 JPEG (灰色图像):
+ * 	DC/AC 各使用只有一个码字 "0" 的 Huffman 表, 每个 block 为 DC diff 0 + EOB, 共 2 bit,
+ * 	故熵编码数据全为 0, 只需在末尾补 1. 不足 bs_size 的部分使用 COM 段填充.
+ */
+
+struct gxmicro_emu_bs {
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t max;
+	bool overflow;
+};
+
+static const uint8_t gxmicro_emu_dqt[] = {
+	0xFF, 0xDB, 0x00, 0x43, 0x00,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+static const uint8_t gxmicro_emu_dht[] = {
+	0xFF, 0xC4, 0x00, 0x26,
+	0x00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00,	/* DC 0 */
+	0x10, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00,	/* AC 0 */
+};
+
+static const uint8_t gxmicro_emu_sos[] = {
+	0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x00, 0x3F, 0x00,
+};
+
+static void gxmicro_emu_put(struct gxmicro_emu_bs *bs, const void *data, uint32_t len)
+{
+	uint32_t n = min(len, bs->max - bs->len);
+
+	if (data)
+		memcpy(bs->buf + bs->len, data, n);
+	else
+		memset(bs->buf + bs->len, 0, n);
+
+	bs->len += n;
+	if (n < len)
+		bs->overflow = true;
+}
+
+static void gxmicro_emu_bitstream(struct gxmicro_emu *emu, struct gxmicro_emu_bs *bs)
+{
+	uint32_t w = emu->regs[EMU_REG(JPEG_WIDTH)];
+	uint32_t h = emu->regs[EMU_REG(JPEG_HEIGHT)];
+	uint32_t qp = clamp_t(uint32_t, emu->regs[EMU_REG(JPEG_ENC_QP)], JPEG_QP_MIN, JPEG_QP_MAX);
+	bool yuv420 = FIELD_GET(JPEG_BS_FORMAT_MASK, emu->regs[EMU_REG(JPEG_CONF)]) == JEPG_BS_YUV420;
+	uint32_t mcus, nbits, target, hdr, pad;
+	uint8_t sof[19], com[4], last;
+
+	/* SOI */
+	gxmicro_emu_put(bs, "\xFF\xD8", 2);
+	gxmicro_emu_put(bs, gxmicro_emu_dqt, sizeof(gxmicro_emu_dqt));
+
+	/* SOF0: 8 bit, 3 components, Y 2x2 (4:2:0) or 1x1 (4:4:4), Cb/Cr 1x1 */
+	sof[0] = 0xFF; sof[1] = 0xC0; sof[2] = 0x00; sof[3] = 0x11; sof[4] = 8;
+	sof[5] = h >> 8; sof[6] = h; sof[7] = w >> 8; sof[8] = w; sof[9] = 3;
+	sof[10] = 1; sof[11] = yuv420 ? 0x22 : 0x11; sof[12] = 0;
+	sof[13] = 2; sof[14] = 0x11; sof[15] = 0;
+	sof[16] = 3; sof[17] = 0x11; sof[18] = 0;
+	gxmicro_emu_put(bs, sof, sizeof(sof));
+
+	gxmicro_emu_put(bs, gxmicro_emu_dht, sizeof(gxmicro_emu_dht));
+
+	if (yuv420) {
+		mcus = DIV_ROUND_UP(w, 16) * DIV_ROUND_UP(h, 16);
+		nbits = mcus * 6 * 2;
+	} else {
+		mcus = DIV_ROUND_UP(w, 8) * DIV_ROUND_UP(h, 8);
+		nbits = mcus * 3 * 2;
+	}
+
+	/* COM padding up to bs_size * JPEG_QP_DEF / QP */
+	target = (uint32_t)div_u64((uint64_t)READ_ONCE(bs_size) * JPEG_QP_DEF, qp);
+	hdr = bs->len + sizeof(gxmicro_emu_sos) + DIV_ROUND_UP(nbits, 8) + 2;
+	pad = target > hdr ? target - hdr : 0;
+	while (pad > sizeof(com)) {
+		uint32_t n = min_t(uint32_t, pad - sizeof(com), 0xFFFF - 2);
+
+		com[0] = 0xFF; com[1] = 0xFE; com[2] = (n + 2) >> 8; com[3] = n + 2;
+		gxmicro_emu_put(bs, com, sizeof(com));
+		gxmicro_emu_put(bs, NULL, n);
+		pad -= n + sizeof(com);
+
+		if (bs->overflow)
+			return;
+	}
+
+	gxmicro_emu_put(bs, gxmicro_emu_sos, sizeof(gxmicro_emu_sos));
+
+	/* Entropy coded data: all zero, pad the last byte with 1 */
+	gxmicro_emu_put(bs, NULL, nbits / 8);
+	if (nbits % 8) {
+		last = 0xFF >> (nbits % 8);
+		gxmicro_emu_put(bs, &last, 1);
+	}
+
+	/* EOI */
+	gxmicro_emu_put(bs, "\xFF\xD9", 2);
+}
+
+/* ****************************** Framebuffer ****************************** */
+
+/*
+ * 源图像 (XRGB8888, 黑色背景), 供 tile 哈希使用, 编码不读取.
+ * fb_update_ms 非 0 时周期性将一个 JPEG_TILE_SIZE x JPEG_TILE_SIZE 白色方块移动到下一个位置.
+ */
+
+static void gxmicro_emu_fb_block(struct gxmicro_emu *emu, uint32_t pos, uint32_t color)
+{
+	uint32_t nx = max_t(uint32_t, width / JPEG_TILE_SIZE, 1);
+	uint32_t ny = max_t(uint32_t, height / JPEG_TILE_SIZE, 1);
+	uint32_t x0 = (pos % nx) * JPEG_TILE_SIZE;
+	uint32_t y0 = (pos / nx % ny) * JPEG_TILE_SIZE;
+	uint32_t w = min_t(uint32_t, JPEG_TILE_SIZE, width - x0);
+	uint32_t h = min_t(uint32_t, JPEG_TILE_SIZE, height - y0);
+	uint32_t x, y;
+
+	for (y = y0; y < y0 + h; y++)
+		for (x = x0; x < x0 + w; x++)
+			WRITE_ONCE(emu->fb[y * width + x], color);
+}
+
+static void gxmicro_emu_fb_update(struct work_struct *work)
+{
+	struct gxmicro_emu *emu = container_of(work, struct gxmicro_emu, fb_work.work);
+
+	gxmicro_emu_fb_block(emu, emu->fb_pos, 0);
+	emu->fb_pos++;
+	gxmicro_emu_fb_block(emu, emu->fb_pos, 0x00FFFFFF);
+
+	schedule_delayed_work(&emu->fb_work, msecs_to_jiffies(fb_update_ms));
+}
+
+/* 与 JPEG_BS_BASE 相同, 在模拟设备上分配, 一致性内存, 连续 (超过 MAX_ORDER 时需要 CMA) */
+static void gxmicro_emu_fb_init(struct gxmicro_emu *emu)
+{
+	struct device *dev = &emu->pdev->dev;
+
+	emu->fb_size = JPEG_SZ(height, JPEG_BPL(width, JPEG_32BPP));
+	emu->fb = dma_alloc_coherent(dev, emu->fb_size, &emu->fb_dma, GFP_KERNEL);
+	if (!emu->fb) {
+		/* JPEG_FB_BASE 为 0, 驱动不检测变化 */
+		pr_warn(EMU_NAME ": Failed to allocate %zu bytes framebuffer\n", emu->fb_size);
+		return;
+	}
+
+	emu->regs[EMU_REG(JPEG_FB_BASE)] = dma_to_phys(dev, emu->fb_dma);
+
+	gxmicro_emu_fb_block(emu, emu->fb_pos, 0x00FFFFFF);
+	if (fb_update_ms)
+		schedule_delayed_work(&emu->fb_work, msecs_to_jiffies(fb_update_ms));
+}
+
+static void gxmicro_emu_fb_fini(struct gxmicro_emu *emu)
+{
+	if (!emu->fb)
+		return;
+
+	cancel_delayed_work_sync(&emu->fb_work);
+	dma_free_coherent(&emu->pdev->dev, emu->fb_size, emu->fb, emu->fb_dma);
+}
+
+/* ****************************** Encoder ****************************** */
+
+static enum hrtimer_restart gxmicro_emu_encode(struct hrtimer *timer)
+{
+	struct gxmicro_emu *emu = container_of(timer, struct gxmicro_emu, timer);
+	struct device *dev = &emu->pdev->dev;
+	struct gxmicro_emu_bs bs = { 0 };
+	phys_addr_t phys;
+	unsigned long flags;
+	bool fire;
+
+	spin_lock_irqsave(&emu->lock, flags);
+
+	if (!emu->busy) {
+		spin_unlock_irqrestore(&emu->lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	emu->busy = false;
+
+	phys = dma_to_phys(dev, emu->regs[EMU_REG(JPEG_BS_BASE)]);
+	if (pfn_valid(PHYS_PFN(phys))) {
+		bs.buf = phys_to_virt(phys);
+		bs.max = emu->regs[EMU_REG(JPEG_BS_LEN_MAX)];
+		gxmicro_emu_bitstream(emu, &bs);
+	} else {
+		dev_err_ratelimited(dev, "Invalid JPEG_BS_BASE %pa\n", &phys);
+	}
+
+	emu->regs[EMU_REG(JPEG_BS_LENGTH)] = bs.len;
+	emu->regs[EMU_REG(JPEG_INTR)] |= bs.overflow ? JPEG_BS_OVERFLOW : JPEG_EOF;
+	fire = emu->regs[EMU_REG(JPEG_CONF)] & JPEG_INTR_ENABLE;
+
+	spin_unlock_irqrestore(&emu->lock, flags);
+
+	if (fire)
+		irq_set_irqchip_state(emu->irq, IRQCHIP_STATE_PENDING, true);
+
+	return HRTIMER_NORESTART;
+}
+
+/* ****************************** Registers ****************************** */
+
+static uint32_t gxmicro_emu_read(void *priv, uint32_t reg)
+{
+	struct gxmicro_emu *emu = priv;
+	unsigned long flags;
+	uint32_t value;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	value = emu->regs[EMU_REG(reg)];
+	spin_unlock_irqrestore(&emu->lock, flags);
+
+	return value;
+}
+
+static void gxmicro_emu_write(void *priv, uint32_t reg, uint32_t value)
+{
+	struct gxmicro_emu *emu = priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu->lock, flags);
+
+	switch (reg) {
+	case JPEG_CTRL:
+		if ((value & JPEG_ENC_START) && !emu->busy) {
+			emu->busy = true;
+			hrtimer_start(&emu->timer, us_to_ktime(READ_ONCE(encode_us)), HRTIMER_MODE_REL);
+		} else if (!(value & JPEG_ENC_START)) {
+			/* callback may be running on another CPU, it checks busy */
+			emu->busy = false;
+			hrtimer_try_to_cancel(&emu->timer);
+		}
+		break;
+	case JPEG_INTR:		/* write 1 clear */
+		emu->regs[EMU_REG(reg)] &= ~value;
+		break;
+	case JPEG_BS_LENGTH:	/* Read only */
+	case JPEG_VERSION:
+		break;
+	default:
+		emu->regs[EMU_REG(reg)] = value;
+		break;
+	}
+
+	spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+/* ****************************** Module Init & Exit ****************************** */
+
+static int gxmicro_emu_irq_init(struct gxmicro_emu *emu)
+{
+	int ret;
+
+	emu->fwnode = irq_domain_alloc_named_fwnode(EMU_NAME);
+	if (!emu->fwnode)
+		return -ENOMEM;
+
+	emu->domain = irq_domain_create_sim(emu->fwnode, 1);
+	if (IS_ERR(emu->domain)) {
+		ret = PTR_ERR(emu->domain);
+		goto err_create_sim;
+	}
+
+	emu->irq = irq_create_mapping(emu->domain, 0);
+	if (!emu->irq) {
+		ret = -ENXIO;
+		goto err_create_mapping;
+	}
+
+	return 0;
+
+err_create_mapping:
+	irq_domain_remove_sim(emu->domain);
+err_create_sim:
+	irq_domain_free_fwnode(emu->fwnode);
+	return ret;
+}
+
+static void gxmicro_emu_irq_fini(struct gxmicro_emu *emu)
+{
+	irq_dispose_mapping(emu->irq);
+	irq_domain_remove_sim(emu->domain);
+	irq_domain_free_fwnode(emu->fwnode);
+}
+
+static int gxmicro_emu_pdev_init(struct gxmicro_emu *emu)
+{
+	struct resource res = DEFINE_RES_IRQ(emu->irq);
+	struct gxmicro_jpeg_pdata pdata = {
+		.read = gxmicro_emu_read,
+		.write = gxmicro_emu_write,
+		.priv = emu,
+	};
+	int ret;
+
+	/* platform_device_alloc() 默认 32 bit dma mask, 与 JPEG_BS_BASE 一致 */
+	emu->pdev = platform_device_alloc(DRVNAME, PLATFORM_DEVID_NONE);
+	if (!emu->pdev)
+		return -ENOMEM;
+
+	ret = platform_device_add_resources(emu->pdev, &res, 1);
+	if (ret)
+		goto err_pdev_add;
+
+	ret = platform_device_add_data(emu->pdev, &pdata, sizeof(pdata));
+	if (ret)
+		goto err_pdev_add;
+
+	/* JPEG_FB_BASE 在驱动 probe 前有效 */
+	gxmicro_emu_fb_init(emu);
+
+	ret = platform_device_add(emu->pdev);
+	if (ret)
+		goto err_fb_init;
+
+	return 0;
+
+err_fb_init:
+	gxmicro_emu_fb_fini(emu);
+err_pdev_add:
+	platform_device_put(emu->pdev);
+	return ret;
+}
+
+static int __init gxmicro_emu_init(void)
+{
+	struct gxmicro_emu *emu;
+	int ret;
+
+	if (width < JPEG_MIN_WIDTH || width > JPEG_MAX_WIDTH ||
+	    height < JPEG_MIN_HEIGHT || height > JPEG_MAX_HEIGHT)
+		return -EINVAL;
+
+	emu = kzalloc(sizeof(struct gxmicro_emu), GFP_KERNEL);
+	if (!emu)
+		return -ENOMEM;
+
+	spin_lock_init(&emu->lock);
+	hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	emu->timer.function = gxmicro_emu_encode;
+	INIT_DELAYED_WORK(&emu->fb_work, gxmicro_emu_fb_update);
+
+	emu->regs[EMU_REG(JPEG_CONF)] = JPEG_ENC_XRGB888;
+	emu->regs[EMU_REG(JPEG_WIDTH)] = width;
+	emu->regs[EMU_REG(JPEG_HEIGHT)] = height;
+	emu->regs[EMU_REG(JPEG_ENC_QP)] = JPEG_QP_DEF;
+	emu->regs[EMU_REG(JPEG_VERSION)] = EMU_VERSION;
+
+	ret = gxmicro_emu_irq_init(emu);
+	if (ret)
+		goto err_irq_init;
+
+	ret = gxmicro_emu_pdev_init(emu);
+	if (ret)
+		goto err_pdev_init;
+
+	gemu = emu;
+
+	return 0;
+
+err_pdev_init:
+	gxmicro_emu_irq_fini(emu);
+err_irq_init:
+	kfree(emu);
+	return ret;
+}
+
+static void __exit gxmicro_emu_exit(void)
+{
+	struct gxmicro_emu *emu = gemu;
+
+	platform_device_del(emu->pdev);
+
+	hrtimer_cancel(&emu->timer);
+	gxmicro_emu_fb_fini(emu);
+	platform_device_put(emu->pdev);
+
+	gxmicro_emu_irq_fini(emu);
+
+	kfree(emu);
+}
+
+module_init(gxmicro_emu_init);
+module_exit(gxmicro_emu_exit);
+
+MODULE_DESCRIPTION("GXMicro JPEG Emulated Engine");
+MODULE_AUTHOR("Zheng DongXiong <zhengdongxiong@gxmicro.cn>");
+MODULE_VERSION("v1.0");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,368 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro JPEG Stream Readers
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+
+#include "gxmicro_jpeg.h"
+
+/*
+ * capture 队列完成的码流在 irq thread 中复制一次, 以引用计数的方式放入每个 reader 的队列.
+ * reader 不拥有 vb2 队列, 只在队列所有者 STREAMON 或后台快照编码时收到帧.
+ * 最新的一帧保留在 fanout->last, 新的 reader 与 VIDIOC_GXMICRO_G_SNAPSHOT 不需要等待编码.
+ * STREAMON 期间没有 reader 时不复制码流, last 标记为 stale; 此时 G_SNAPSHOT 请求复制下一帧,
+ * 新的 reader 从下一帧开始接收. 硬中断中完成或非 MMAP 的帧无法复制, 由后台快照编码代替.
+ * 帧可能在 fanout->lock 中释放, 使用 kvfree_rcu().
+ *
+ * 为什么复制而不引用 vb2 buffer: vb2 buffer 属于队列所有者, DQBUF 后由其 QBUF 交还编码器覆盖,
+ * reader 持有它会使所有者的队列缺少 buffer (编码器停在最后一个 buffer 上), 快照 buffer 也在下次快照时覆盖.
+ * 因此每帧只复制一次, 无论多少 reader 都共享该副本; 没有 reader 与快照请求时不复制.
+ * 长度在硬中断中已限制在 plane 大小内 (gxmicro_buf_length()).
+ */
+
+struct gxmicro_frame {
+	struct kref ref;
+	struct rcu_head rcu;
+	uint32_t sequence;
+	uint32_t flags;
+	uint64_t timestamp;
+	uint32_t size;
+	uint8_t data[];
+};
+
+struct gxmicro_reader {
+	struct list_head list;	/* gdev->fanout.readers */
+	uint32_t policy;
+	uint32_t depth;
+	uint32_t head, count;	/* gdev->fanout.lock */
+	uint32_t drops;
+	struct gxmicro_frame *ring[];
+};
+
+static void gxmicro_frame_release(struct kref *ref)
+{
+	struct gxmicro_frame *frame = container_of(ref, struct gxmicro_frame, ref);
+
+	kvfree_rcu(frame, rcu);
+}
+
+static inline void gxmicro_frame_put(struct gxmicro_frame *frame)
+{
+	kref_put(&frame->ref, gxmicro_frame_release);
+}
+
+/* gdev->fanout.lock spinlock must be held by caller */
+static struct gxmicro_frame *gxmicro_reader_pop(struct gxmicro_reader *reader)
+{
+	struct gxmicro_frame *frame;
+
+	if (!reader->count)
+		return NULL;
+
+	frame = reader->ring[reader->head];
+	reader->head = (reader->head + 1) % reader->depth;
+	reader->count--;
+
+	return frame;
+}
+
+/* gdev->fanout.lock spinlock must be held by caller */
+static void gxmicro_reader_push(struct gxmicro_reader *reader, struct gxmicro_frame *frame)
+{
+	if (reader->count == reader->depth) {
+		reader->drops++;
+		if (reader->policy == GXMICRO_READER_DROP_NEWEST)
+			return;
+		gxmicro_frame_put(gxmicro_reader_pop(reader));
+	}
+
+	kref_get(&frame->ref);
+	reader->ring[(reader->head + reader->count) % reader->depth] = frame;
+	reader->count++;
+}
+
+/* 有 reader 或等待中的 G_SNAPSHOT 时才需要复制完成的帧 */
+bool gxmicro_fanout_wanted(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+
+	return READ_ONCE(fanout->nr_readers) || atomic_read(&fanout->wanted);
+}
+
+/* irq thread 或快照 work 中调用, 不持有 gdev->buf_lock */
+void gxmicro_fanout_publish(struct gxmicro_jpeg_dev *gdev, const void *data, uint32_t size,
+			    uint32_t sequence, uint64_t timestamp, uint32_t flags)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+	struct gxmicro_reader *reader;
+	struct gxmicro_frame *frame, *last;
+	unsigned long irqflags;
+
+	frame = kvmalloc(struct_size(frame, data, size), GFP_KERNEL);
+	if (!frame)
+		return;
+
+	kref_init(&frame->ref);
+	frame->sequence = sequence;
+	frame->flags = flags;
+	frame->timestamp = timestamp;
+	frame->size = size;
+	memcpy(frame->data, data, size);
+
+	spin_lock_irqsave(&fanout->lock, irqflags);
+	list_for_each_entry(reader, &fanout->readers, list)
+		gxmicro_reader_push(reader, frame);
+	last = fanout->last;
+	fanout->last = frame;	/* 初始引用转给 last */
+	WRITE_ONCE(fanout->gen, fanout->gen + 1);
+	WRITE_ONCE(fanout->stale, false);
+	spin_unlock_irqrestore(&fanout->lock, irqflags);
+
+	if (last)
+		gxmicro_frame_put(last);
+
+	/* reader 与 G_SNAPSHOT */
+	wake_up_interruptible(&fanout->wait);
+}
+
+static int gxmicro_frame_copy(struct gxmicro_frame *frame, struct gxmicro_frame_info *info)
+{
+	info->bytesused = frame->size;
+	info->sequence = frame->sequence;
+	info->flags = frame->flags;
+	info->timestamp = frame->timestamp;
+
+	/* buffer 太小时该帧丢弃, 仍返回 bytesused; length 应不小于 G_FMT 的 sizeimage */
+	if (info->length < frame->size)
+		return -ENOSPC;
+
+	if (copy_to_user(u64_to_user_ptr(info->data), frame->data, frame->size))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* last 已过期: 请求复制下一帧并等待, 可睡眠 */
+static int gxmicro_fanout_refresh(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+	uint32_t gen = READ_ONCE(fanout->gen);
+	long ret;
+
+	/* 既没有实时采集分发, 也没有后台快照, 不会再有新帧 */
+	if (!gxmicro_vb2_publishes(gdev) && !gxmicro_snap_request(gdev))
+		return -ENODATA;
+
+	atomic_inc(&fanout->wanted);
+	ret = wait_event_interruptible_timeout(fanout->wait, READ_ONCE(fanout->gen) != gen,
+					       msecs_to_jiffies(JPEG_SNAPSHOT_TIMEOUT));
+	atomic_dec(&fanout->wanted);
+
+	if (ret < 0)
+		return ret;
+
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/* 最新完成的一帧, 不影响 reader 队列 */
+int gxmicro_fanout_snapshot(struct gxmicro_jpeg_dev *gdev, struct gxmicro_frame_info *info)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+	struct gxmicro_frame *frame;
+	unsigned long flags;
+	int ret;
+
+	if (READ_ONCE(fanout->stale)) {
+		ret = gxmicro_fanout_refresh(gdev);
+		if (ret)
+			return ret;
+	}
+
+	spin_lock_irqsave(&fanout->lock, flags);
+	frame = fanout->last;
+	if (frame)
+		kref_get(&frame->ref);
+	spin_unlock_irqrestore(&fanout->lock, flags);
+
+	if (!frame)
+		return -ENODATA;
+
+	info->drops = 0;
+	ret = gxmicro_frame_copy(frame, info);
+
+	gxmicro_frame_put(frame);
+
+	return ret;
+}
+
+/* ****************************** Reader ****************************** */
+
+/* gdev->vlock mutex must be held by caller */
+int gxmicro_reader_attach(struct gxmicro_jpeg_dev *gdev, struct gxmicro_fh *gfh,
+			  const struct gxmicro_reader_cfg *cfg)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+	struct gxmicro_reader *reader;
+	unsigned long flags;
+
+	if (gfh->reader)
+		return -EBUSY;
+
+	if (!cfg->depth || cfg->depth > GXMICRO_READER_DEPTH_MAX)
+		return -EINVAL;
+
+	if (cfg->policy != GXMICRO_READER_DROP_OLDEST && cfg->policy != GXMICRO_READER_DROP_NEWEST)
+		return -EINVAL;
+
+	/* 不会收到任何帧 */
+	if (!gxmicro_vb2_can_publish(gdev))
+		return -EOPNOTSUPP;
+
+	reader = kzalloc(struct_size(reader, ring, cfg->depth), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	reader->depth = cfg->depth;
+	reader->policy = cfg->policy;
+
+	spin_lock_irqsave(&fanout->lock, flags);
+	/* 第一帧立即可读; last 已过期时从下一帧开始 */
+	if (fanout->last && !fanout->stale)
+		gxmicro_reader_push(reader, fanout->last);
+	list_add_tail(&reader->list, &fanout->readers);
+	WRITE_ONCE(fanout->nr_readers, fanout->nr_readers + 1);
+	spin_unlock_irqrestore(&fanout->lock, flags);
+
+	WRITE_ONCE(gfh->reader, reader);
+
+	/* 实时采集的帧无法分发时, 不等待下一个 snapshot_ms */
+	if (READ_ONCE(fanout->stale))
+		gxmicro_snap_request(gdev);
+
+	return 0;
+}
+
+/* gdev->vlock mutex must be held by caller, release 时调用 */
+void gxmicro_reader_detach(struct gxmicro_jpeg_dev *gdev, struct gxmicro_fh *gfh)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+	struct gxmicro_reader *reader = gfh->reader;
+	struct gxmicro_frame *frame;
+	unsigned long flags;
+
+	if (!reader)
+		return;
+
+	spin_lock_irqsave(&fanout->lock, flags);
+	list_del(&reader->list);
+	WRITE_ONCE(fanout->nr_readers, fanout->nr_readers - 1);
+	while ((frame = gxmicro_reader_pop(reader)))
+		gxmicro_frame_put(frame);
+	spin_unlock_irqrestore(&fanout->lock, flags);
+
+	gfh->reader = NULL;
+	kfree(reader);
+}
+
+static struct gxmicro_frame *gxmicro_reader_wait(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+						 bool nonblock)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+	struct gxmicro_frame *frame;
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&fanout->lock, flags);
+		frame = gxmicro_reader_pop(reader);
+		spin_unlock_irqrestore(&fanout->lock, flags);
+		if (frame)
+			return frame;
+
+		if (nonblock)
+			return ERR_PTR(-EAGAIN);
+
+		ret = wait_event_interruptible(fanout->wait, READ_ONCE(reader->count));
+		if (ret)
+			return ERR_PTR(ret);
+	}
+}
+
+/* 不持有 gdev->vlock, 阻塞时不影响其他 ioctl, see gxmicro_jpeg_ioctl() */
+int gxmicro_reader_dqframe(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+			   struct gxmicro_frame_info *info, bool nonblock)
+{
+	struct gxmicro_frame *frame;
+	int ret;
+
+	frame = gxmicro_reader_wait(gdev, reader, nonblock);
+	if (IS_ERR(frame))
+		return PTR_ERR(frame);
+
+	info->drops = READ_ONCE(reader->drops);
+	ret = gxmicro_frame_copy(frame, info);
+
+	gxmicro_frame_put(frame);
+
+	return ret;
+}
+
+/* 每次 read() 返回一帧完整的 JPEG */
+ssize_t gxmicro_reader_read(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+			    char __user *buf, size_t count, bool nonblock)
+{
+	struct gxmicro_frame *frame;
+	ssize_t ret;
+
+	frame = gxmicro_reader_wait(gdev, reader, nonblock);
+	if (IS_ERR(frame))
+		return PTR_ERR(frame);
+
+	if (count < frame->size)
+		ret = -ENOSPC;
+	else if (copy_to_user(buf, frame->data, frame->size))
+		ret = -EFAULT;
+	else
+		ret = frame->size;
+
+	gxmicro_frame_put(frame);
+
+	return ret;
+}
+
+__poll_t gxmicro_reader_poll(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+			     struct file *file, poll_table *wait)
+{
+	poll_wait(file, &gdev->fanout.wait, wait);
+
+	return READ_ONCE(reader->count) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+void gxmicro_fanout_init(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+
+	spin_lock_init(&fanout->lock);
+	INIT_LIST_HEAD(&fanout->readers);
+	init_waitqueue_head(&fanout->wait);
+	atomic_set(&fanout->wanted, 0);
+}
+
+/* video 节点注销后调用 */
+void gxmicro_fanout_fini(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_fanout *fanout = &gdev->fanout;
+
+	if (fanout->last)
+		gxmicro_frame_put(fanout->last);
+	fanout->last = NULL;
+}
@@ -10,10 +10,21 @@
 #ifndef __GXMICRO_JPEG_H__
 #define __GXMICRO_JPEG_H__
 
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/completion.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include <media/media-device.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ctrls.h>
 #include <media/videobuf2-core.h>
 
+#include "gxmicro_uapi.h"
+
 #define DRVNAME		"GXMicro-jpeg"
 
 /* ****************************** JPEG Controller ****************************** */
@@ -23,6 +34,8 @@
 #define JPEG_OFFSET(offset)		(JPEG_BASE + offset)
 
 #define JPEG_RATE			30
+#define JPEG_MIN_RATE			1
+#define JPEG_MAX_RATE			60
 #define JPEG_MIN_WIDTH			640
 #define JPEG_MIN_HEIGHT			480
 #define JPEG_MIN_PCLK			12587500	/* 640 x 480 x 30Hz, pclk (640 x 480 60Hz) / 2 */
@@ -69,23 +82,211 @@
 /* JEPG BS Len Max Resgister */
 #define JPEG_MAX_BS			(((JPEG_MAX_WIDTH) * (JPEG_MAX_HEIGHT) * (JPEG_32BPP)) / 8)
 #define JPEG_MIN_BS			0
+#define JPEG_BS_HDR			1024		/* SOI, DQT, SOF, DHT, SOS, EOI */
+#define JPEG_BS_QP_SCALE		8		/* 码流估算: raw * QP_DEF / (QP_DEF + QP * SCALE) */
+#define JPEG_RETRY_DEF			2		/* JPEG_BS_OVERFLOW 后重新编码次数 */
+
+/* JEPG FB Base: tile 变化检测 */
+#define JPEG_TILE_SIZE			64
+#define JPEG_TILES_MAX			(DIV_ROUND_UP(JPEG_MAX_WIDTH, JPEG_TILE_SIZE) * \
+					 DIV_ROUND_UP(JPEG_MAX_HEIGHT, JPEG_TILE_SIZE))
 
 /* JEPG Quality Resgister */
 #define JPEG_QP_MAX			2047
 #define JPEG_QP_MIN			1
 #define JPEG_QP_DEF			128
 
+/* Rate Control */
+#define JPEG_RC_BITRATE_MIN		64000
+#define JPEG_RC_BITRATE_MAX		200000000
+#define JPEG_RC_BITRATE_DEF		8000000		/* 8 Mbps */
+#define JPEG_RC_GAIN_MIN		1
+#define JPEG_RC_GAIN_MAX		16
+#define JPEG_RC_GAIN_DEF		4
+#define JPEG_RC_GAIN_DIV		16
+
+/* Duplicate Frames */
+#define JPEG_DUP_KEEPALIVE_MAX		60000	/* ms */
+#define JPEG_DUP_KEEPALIVE_DEF		1000
+
+/* Snapshot */
+#define JPEG_SNAPSHOT_DEF		1000	/* ms, 未 STREAMON 时后台编码间隔 */
+#define JPEG_SNAPSHOT_TIMEOUT		1000	/* ms */
+
 /* JEPG Intr Resgister */
 #define JPEG_BS_OVERFLOW		BIT(8)
 #define JPEG_EOF			BIT(0)
 #define JPEG_INTR_MASK			(JPEG_BS_OVERFLOW | JPEG_EOF)
 
+/* ****************************** Emulated Engine ****************************** */
+
+/* platform data of the software register model, see gxmicro_emu.c */
+struct gxmicro_jpeg_pdata {
+	uint32_t (*read)(void *priv, uint32_t reg);
+	void (*write)(void *priv, uint32_t reg, uint32_t value);
+	void *priv;
+};
+
+struct gxmicro_rc {
+	bool enable;		/* V4L2_MPEG_VIDEO_BITRATE_MODE_CBR */
+	uint32_t bitrate;	/* bps */
+	uint32_t gain;		/* 1 / JPEG_RC_GAIN_DIV */
+};
+
+/* gdev->buf_lock spinlock */
+struct gxmicro_stats {
+	uint32_t overflows;	/* JPEG_BS_OVERFLOW */
+	uint32_t retries;	/* overflow 后重新编码 */
+	uint32_t drops;		/* low latency 丢弃的帧 */
+	uint32_t skips;		/* 画面未变化, 跳过编码 */
+	uint32_t dups;		/* 未输出的重复帧 */
+};
+
+/* debugfs 累计统计, 不随 STREAMON 清零, gdev->buf_lock spinlock, see gxmicro_debugfs.c */
+#define JPEG_HIST_BUCKETS		20	/* log2(us): [0, 2) [2, 4) ... [2^19, ) */
+
+struct gxmicro_hist {
+	uint64_t count[JPEG_HIST_BUCKETS];
+};
+
+struct gxmicro_debug {
+	uint64_t encoded;	/* EOF, 包括 overflow 后重新编码 */
+	uint64_t frames;	/* 正常返回给用户的帧 */
+	uint64_t errors;	/* 重新编码后仍 overflow 或源分辨率变化, VB2_BUF_STATE_ERROR */
+	uint64_t drops;		/* low latency 丢弃与未输出的重复帧 */
+	uint64_t overflows;	/* JPEG_BS_OVERFLOW */
+	uint64_t bytes;		/* frames 的 JPEG_BS_LENGTH 之和 */
+	struct gxmicro_hist encode;	/* JPEG_ENC_START -> EOF */
+	struct gxmicro_hist done;	/* EOF -> vb2_buffer_done */
+	struct gxmicro_hist hash;	/* gxmicro_tile_update() */
+};
+
+/* 重复帧检测, 在 irq thread 中访问 */
+struct gxmicro_dup {
+	uint32_t mode;		/* V4L2_CID_GXMICRO_DUP_MODE */
+	ktime_t keepalive;	/* V4L2_CID_GXMICRO_DUP_KEEPALIVE */
+
+	bool valid;		/* len, hash 为上一帧的结果 */
+	uint32_t len;		/* JPEG_BS_LENGTH */
+	uint64_t hash;
+	ktime_t last;		/* 上一次输出的时刻 */
+};
+
+/* JPEG_FB_BASE 源图像 tile 哈希, 在 start_work 中访问 */
+#define JPEG_TILE_STRIDE_MAX		4	/* uncached 映射时每帧哈希 1 / 4 的行 */
+
+struct gxmicro_tile {
+	bool enable;		/* V4L2_CID_GXMICRO_SKIP_UNCHANGED */
+
+	void *vaddr;		/* JPEG_FB_BASE, coherent 时 write-back, 否则 write-combine */
+	uint32_t width, height, cpp, bpl, size;
+	uint32_t tiles_x, tiles_y;
+	uint32_t stride;	/* 每帧哈希 y % stride == phase 的行, phase 逐帧轮换 */
+	uint32_t phase;
+
+	uint32_t valid;		/* bit n: hash[n] 为上一次 phase n 的结果 */
+	uint64_t hash[JPEG_TILE_STRIDE_MAX][JPEG_TILES_MAX];
+	uint64_t cur[JPEG_TILES_MAX];
+	DECLARE_BITMAP(dirty, JPEG_TILES_MAX);
+};
+
+/* V4L2_BUF_TYPE_META_CAPTURE, see gxmicro_meta.c */
+struct gxmicro_meta {
+	struct vb2_queue vbq;
+	struct video_device vdev;
+	struct mutex lock;	/* video, videobuf2 fops lock */
+	bool tiles;		/* V4L2_CID_GXMICRO_META_TILES */
+
+	/* gdev->buf_lock spinlock */
+	struct list_head buffers;
+	struct list_head held;	/* 已填写, 等待 irq thread 重复帧检测的记录 */
+	bool streaming;
+	bool pending;		/* dirty 为上一条记录之后累加的结果 */
+	bool full;		/* 期间有无法计算哈希的帧 */
+	uint32_t tiles_x, tiles_y;
+	DECLARE_BITMAP(dirty, JPEG_TILES_MAX);
+};
+
+/* v4l2-mem2mem, see gxmicro_m2m.c */
+struct gxmicro_m2m_ctx;
+
+struct gxmicro_m2m {
+	struct v4l2_m2m_dev *m2m_dev;
+	struct video_device vdev;
+	struct mutex lock;	/* video, videobuf2 fops lock */
+
+	/* gdev->buf_lock spinlock */
+	struct gxmicro_m2m_ctx *ctx;	/* device_run() 的 job */
+	bool pending;		/* job 等待编码器空闲 */
+	bool active;		/* 编码器正在执行 job */
+	bool deferred;		/* 实时采集的下一帧等待 job 完成 */
+	uint32_t fb_base, width, height, jconf;	/* 实时采集的寄存器, job 完成后恢复 */
+};
+
+/* 多 reader 分发, see gxmicro_fanout.c */
+struct gxmicro_reader;
+struct gxmicro_frame;
+
+struct gxmicro_fanout {
+	spinlock_t lock;	/* readers, reader 队列, last */
+	struct list_head readers;
+	uint32_t nr_readers;
+	wait_queue_head_t wait;
+	struct gxmicro_frame *last;	/* 最新分发的帧 */
+	uint32_t gen;		/* last 更新次数 */
+	bool stale;		/* 之后有未复制的帧完成, last 不是最新画面 */
+	atomic_t wanted;	/* 等待新帧的 VIDIOC_GXMICRO_G_SNAPSHOT */
+};
+
+/* 未 STREAMON 或实时采集无法分发时后台编码, 保持 fanout.last 最新, see gxmicro_vb2.c */
+struct gxmicro_snap {
+	struct delayed_work work;
+	struct completion done;
+	void *vaddr;		/* dma_alloc_coherent() */
+	dma_addr_t dma;		/* JPEG_BS_BASE */
+	uint32_t size;		/* JPEG_BS_LEN_MAX */
+	bool pending;		/* 等待编码器空闲 */
+	bool active;		/* 编码器执行快照编码 */
+	bool deferred;		/* 实时采集的帧在快照完成后启动 */
+	uint32_t jconf;		/* 快照前的 JPEG_CONF, 完成后恢复 */
+	uint32_t fsize;		/* JPEG_BS_LENGTH */
+	uint32_t status;	/* JPEG_INTR */
+	uint64_t timestamp;
+};
+
+/* capture 节点的 file handle */
+struct gxmicro_fh {
+	struct v4l2_fh fh;	/* 必须在第一个, v4l2_fh_release() kfree */
+	struct gxmicro_reader *reader;
+};
+#define fh_to_gxmicro_fh(fh)	container_of(fh, struct gxmicro_fh, fh)
+
+/*
+ * 实时采集的源格式, ioctl 与 vb2 路径只读取缓存, 不访问寄存器, see gxmicro_vb2.c
+ * gdev->buf_lock spinlock
+ */
+struct gxmicro_format {
+	uint32_t width, height;		/* JPEG_WIDTH, JPEG_HEIGHT */
+	uint32_t enc;			/* JPEG_ENC_FORMAT */
+	uint8_t bpp;			/* 0: 不支持的 JPEG_ENC_FORMAT */
+	uint32_t bpl;			/* 原始图像 */
+	enum v4l2_jpeg_chroma_subsampling subsampling;
+	uint32_t sizeimage;		/* 码流上限: 原始 YUV 大小 + 文件头 */
+	uint32_t estimate;		/* V4L2_CID_JPEG_COMPRESSION_QUALITY 的码流估算大小 */
+};
+
+struct gxmicro_buffer;
+
 struct gxmicro_jpeg_dev {
 
 	struct device *dev;
+	int irq;
 
 	void __iomem *mem;
+	bool mem_reserved;	/* 设备树 memory-region */
+	const struct gxmicro_jpeg_pdata *pdata;	/* Emulated engine */
 
+	struct media_device mdev;
 	struct v4l2_device v4l2;
 	struct vb2_queue vbq;
 	struct v4l2_ctrl_handler hdl;
@@ -97,28 +298,138 @@ struct gxmicro_jpeg_dev {
 	/* videobuf2 */
 	spinlock_t buf_lock;	/* buffers list lock */
 	struct list_head buffers;
+	struct list_head done;	/* pipeline: 已编码完成, 等待 irq thread */
+	bool busy;		/* JPEG_ENC_START -> EOF, 或等待 pace 定时器 */
+	bool encoding;		/* 实时采集 JPEG_ENC_START -> EOF */
+
+	/* 源格式, 分辨率变化时发送 V4L2_EVENT_SOURCE_CHANGE */
+	struct gxmicro_format fmt;
+
+	/* 帧率 */
+	struct v4l2_fract timeperframe;
+	ktime_t interval;	/* timeperframe, ns */
+	ktime_t next_start;	/* 下一帧最早的 JPEG_ENC_START 时刻 */
+	struct hrtimer pace;
+	bool pacing;
+
+	/* Low latency */
+	bool low_latency;
+	struct gxmicro_buffer *ready;	/* 最新完成, 等待用户取走上一帧 */
+	uint32_t undequeued;		/* 已完成, 未 DQBUF */
+
+	/* 在进程上下文中启动编码: Request API, 画面变化检测 */
+	struct work_struct start_work;
+	struct gxmicro_tile tile;
+	struct gxmicro_meta meta;
+	struct gxmicro_dup dup;
+	struct gxmicro_m2m m2m;
+	struct gxmicro_fanout fanout;
+	struct gxmicro_snap snap;
 
 	enum v4l2_jpeg_chroma_subsampling subsampling;
+	uint32_t quality;	/* V4L2_CID_JPEG_COMPRESSION_QUALITY */
+	uint32_t qp;		/* JPEG_ENC_QP */
+	struct gxmicro_rc rc;
 	uint32_t sequence;
+
+	struct gxmicro_stats stats;
+
+	struct dentry *debugfs;
+	uint64_t enc_start;	/* 实时采集 JPEG_ENC_START, ns */
+	struct gxmicro_debug debug;
 };
 
 static inline uint32_t gxmicro_read(struct gxmicro_jpeg_dev *gdev, uint32_t reg)
 {
+	if (IS_ENABLED(CONFIG_VIDEO_GXMICRO_EMU) && gdev->pdata)
+		return gdev->pdata->read(gdev->pdata->priv, reg);
+
 	return ioread32(gdev->mem + reg);
 }
 
 static inline void gxmicro_write(struct gxmicro_jpeg_dev *gdev, uint32_t reg, uint32_t value)
 {
-	iowrite32(value, gdev->mem + reg);
+	if (IS_ENABLED(CONFIG_VIDEO_GXMICRO_EMU) && gdev->pdata)
+		gdev->pdata->write(gdev->pdata->priv, reg, value);
+	else
+		iowrite32(value, gdev->mem + reg);
+}
+
+/* gdev->buf_lock spinlock must be held by caller */
+static inline void gxmicro_hist_add(struct gxmicro_hist *hist, uint64_t ns)
+{
+	uint32_t us = div_u64(ns, NSEC_PER_USEC);
+
+	hist->count[min_t(uint32_t, us ? ilog2(us) : 0, JPEG_HIST_BUCKETS - 1)]++;
+}
+
+/*
+ * V4L2_MEMORY_FLAG_NON_COHERENT (5.16 起): 用户以 cached 映射读写 MMAP buffer; 5.15 dma-contig 只分配一致性内存.
+ * 非一致性 buffer 由 dma_alloc_noncontiguous() 分配, 不经过 memory-region 内存池, 有内存池时不启用,
+ * vb2 清除 REQBUFS / CREATE_BUFS 的该标志, 用户可据此发现.
+ */
+static inline void gxmicro_vb2_cache_hints(struct gxmicro_jpeg_dev *gdev, struct vb2_queue *vbq)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	vbq->allow_cache_hints = !gdev->mem_reserved;
+#endif
 }
 
 int gxmicro_ctrls_init(struct gxmicro_jpeg_dev *gdev);
 void gxmicro_ctrls_fini(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_rc_update(struct gxmicro_jpeg_dev *gdev, uint32_t fsize);
+
+int gxmicro_tile_update(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_tile_unmap(struct gxmicro_jpeg_dev *gdev);
 
+void gxmicro_meta_stage(struct gxmicro_jpeg_dev *gdev, bool valid);
+void gxmicro_meta_done(struct gxmicro_jpeg_dev *gdev, uint32_t sequence, uint32_t qp,
+		       uint32_t retries, bool overflow, uint64_t encode_ns, bool hold);
+void gxmicro_meta_release(struct gxmicro_jpeg_dev *gdev, uint32_t sequence, bool repeat);
+void gxmicro_meta_flush(struct gxmicro_jpeg_dev *gdev);
+int gxmicro_meta_init(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_meta_fini(struct gxmicro_jpeg_dev *gdev);
+
+void gxmicro_fanout_init(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_fanout_fini(struct gxmicro_jpeg_dev *gdev);
+bool gxmicro_fanout_wanted(struct gxmicro_jpeg_dev *gdev);
+int gxmicro_fanout_snapshot(struct gxmicro_jpeg_dev *gdev, struct gxmicro_frame_info *info);
+void gxmicro_fanout_publish(struct gxmicro_jpeg_dev *gdev, const void *data, uint32_t size,
+			    uint32_t sequence, uint64_t timestamp, uint32_t flags);
+int gxmicro_reader_attach(struct gxmicro_jpeg_dev *gdev, struct gxmicro_fh *gfh,
+			  const struct gxmicro_reader_cfg *cfg);
+void gxmicro_reader_detach(struct gxmicro_jpeg_dev *gdev, struct gxmicro_fh *gfh);
+int gxmicro_reader_dqframe(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+			   struct gxmicro_frame_info *info, bool nonblock);
+ssize_t gxmicro_reader_read(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+			    char __user *buf, size_t count, bool nonblock);
+__poll_t gxmicro_reader_poll(struct gxmicro_jpeg_dev *gdev, struct gxmicro_reader *reader,
+			     struct file *file, poll_table *wait);
+
+void gxmicro_m2m_run(struct gxmicro_jpeg_dev *gdev);
+struct gxmicro_m2m_ctx *gxmicro_m2m_irq(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_m2m_done(struct gxmicro_jpeg_dev *gdev, struct gxmicro_m2m_ctx *ctx, uint32_t status);
+int gxmicro_m2m_init(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_m2m_fini(struct gxmicro_jpeg_dev *gdev);
+
+uint32_t gxmicro_jpeg_bs_estimate(uint32_t width, uint32_t height,
+				   enum v4l2_jpeg_chroma_subsampling subsampling, uint32_t qp);
+void gxmicro_format_update(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_format_refresh(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_format_poll(struct gxmicro_jpeg_dev *gdev);
+uint32_t gxmicro_source_base(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_format_get(struct gxmicro_jpeg_dev *gdev, struct gxmicro_format *fmt);
+void gxmicro_vb2_set_low_latency(struct gxmicro_jpeg_dev *gdev, bool enable);
+bool gxmicro_vb2_publishes(struct gxmicro_jpeg_dev *gdev);
+bool gxmicro_vb2_can_publish(struct gxmicro_jpeg_dev *gdev);
+bool gxmicro_snap_request(struct gxmicro_jpeg_dev *gdev);
 int gxmicro_vb2_init(struct gxmicro_jpeg_dev *gdev);
 void gxmicro_vb2_fini(struct gxmicro_jpeg_dev *gdev);
 
 int gxmicro_video_init(struct gxmicro_jpeg_dev *gdev);
 void gxmicro_video_fini(struct gxmicro_jpeg_dev *gdev);
 
+void gxmicro_debugfs_init(struct gxmicro_jpeg_dev *gdev);
+void gxmicro_debugfs_fini(struct gxmicro_jpeg_dev *gdev);
+
 #endif /* __GXMICRO_JPEG_H__ */
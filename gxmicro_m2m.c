@@ -0,0 +1,623 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro V4L2 Memory-to-Memory Encoder
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/bitfield.h>
+#include <linux/slab.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-mem2mem.h>
+#include <media/videobuf2-dma-contig.h>
+
+#include "gxmicro_jpeg.h"
+
+#define M2M_INFO	"GXMicro JPEG Encoder"
+
+/*
+ * OUTPUT 队列的原始图像写入 JPEG_FB_BASE, 按其宽高编码, JPEG 由 CAPTURE 队列返回.
+ * 与实时采集共用编码器, 以帧为单位交替:
+ * 	实时采集编码中, job 等待 EOF 后执行 (pending)
+ * 	job 执行中, 实时采集的下一帧在 job 完成后启动 (deferred)
+ * job 修改的 JPEG_FB_BASE, JPEG_WIDTH, JPEG_HEIGHT, JPEG_CONF 在完成后恢复.
+ * job 执行期间 (m2m->active) 实时采集的分辨率检测与 tile 映射使用保存的值, 不读取这些寄存器.
+ */
+
+struct gxmicro_m2m_fmt {
+	uint32_t fourcc;
+	uint32_t enc;		/* JPEG_ENC_FORMAT */
+	uint8_t bpp;
+};
+
+static const struct gxmicro_m2m_fmt gxmicro_m2m_fmts[] = {
+	{ V4L2_PIX_FMT_XRGB32, JPEG_ENC_XRGB888, JPEG_32BPP },
+	{ V4L2_PIX_FMT_RGB565, JPEG_ENC_RBG565, JPEG_16BPP },
+	{ V4L2_PIX_FMT_YUYV, JPEG_ENC_YUV422, JPEG_16BPP },	/* Reserved: YUV422 分量顺序 */
+};
+
+struct gxmicro_m2m_ctx {
+	struct v4l2_fh fh;
+	struct gxmicro_jpeg_dev *gdev;
+	struct v4l2_ctrl_handler hdl;
+
+	const struct gxmicro_m2m_fmt *fmt;
+	uint32_t width, height;
+	uint32_t sizeimage;	/* CAPTURE */
+
+	uint32_t qp;		/* V4L2_CID_JPEG_COMPRESSION_QUALITY */
+	enum v4l2_jpeg_chroma_subsampling subsampling;
+	uint32_t fsize;		/* JPEG_BS_LENGTH */
+	uint32_t sequence;
+};
+#define fh_to_gxmicro_m2m_ctx(fh)	container_of(fh, struct gxmicro_m2m_ctx, fh)
+
+static const struct gxmicro_m2m_fmt *gxmicro_m2m_find_fmt(uint32_t fourcc)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gxmicro_m2m_fmts); i++)
+		if (gxmicro_m2m_fmts[i].fourcc == fourcc)
+			return &gxmicro_m2m_fmts[i];
+
+	return NULL;
+}
+
+/* ****************************** Job ****************************** */
+
+/* gdev->buf_lock spinlock must be held by caller, 编码器空闲 */
+void gxmicro_m2m_run(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_m2m *m2m = &gdev->m2m;
+	struct gxmicro_m2m_ctx *ctx = m2m->ctx;
+	struct vb2_v4l2_buffer *src, *dst;
+	uint32_t jconf;
+
+	m2m->pending = false;
+	m2m->active = true;
+
+	src = v4l2_m2m_next_src_buf(ctx->fh.m2m_ctx);
+	dst = v4l2_m2m_next_dst_buf(ctx->fh.m2m_ctx);
+
+	m2m->fb_base = gxmicro_read(gdev, JPEG_FB_BASE);
+	m2m->width = gxmicro_read(gdev, JPEG_WIDTH);
+	m2m->height = gxmicro_read(gdev, JPEG_HEIGHT);
+	m2m->jconf = gxmicro_read(gdev, JPEG_CONF);
+
+	jconf = m2m->jconf & ~(JPEG_ENC_FORMAT_MASK | JPEG_BS_FORMAT_MASK);
+	jconf |= ctx->fmt->enc | JPEG_INTR_ENABLE;
+	if (READ_ONCE(ctx->subsampling) == V4L2_JPEG_CHROMA_SUBSAMPLING_420)
+		jconf |= FIELD_PREP(JPEG_BS_FORMAT_MASK, JEPG_BS_YUV420);
+	else
+		jconf |= FIELD_PREP(JPEG_BS_FORMAT_MASK, JEPG_BS_YUV444);
+
+	gxmicro_write(gdev, JPEG_FB_BASE, vb2_dma_contig_plane_dma_addr(&src->vb2_buf, 0));
+	gxmicro_write(gdev, JPEG_WIDTH, ctx->width);
+	gxmicro_write(gdev, JPEG_HEIGHT, ctx->height);
+	gxmicro_write(gdev, JPEG_CONF, jconf);
+	gxmicro_write(gdev, JPEG_BS_BASE, vb2_dma_contig_plane_dma_addr(&dst->vb2_buf, 0));
+	gxmicro_write(gdev, JPEG_BS_LEN_MAX, vb2_plane_size(&dst->vb2_buf, 0));
+	gxmicro_write(gdev, JPEG_ENC_QP, READ_ONCE(ctx->qp));
+
+	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_START);
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 硬中断中调用 */
+struct gxmicro_m2m_ctx *gxmicro_m2m_irq(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_m2m *m2m = &gdev->m2m;
+	struct gxmicro_m2m_ctx *ctx = m2m->ctx;
+
+	ctx->fsize = gxmicro_read(gdev, JPEG_BS_LENGTH);
+
+	/* 恢复实时采集 */
+	gxmicro_write(gdev, JPEG_FB_BASE, m2m->fb_base);
+	gxmicro_write(gdev, JPEG_WIDTH, m2m->width);
+	gxmicro_write(gdev, JPEG_HEIGHT, m2m->height);
+	gxmicro_write(gdev, JPEG_CONF, m2m->jconf);
+
+	m2m->active = false;
+	m2m->ctx = NULL;
+
+	return ctx;
+}
+
+/* 不持有 gdev->buf_lock, v4l2_m2m_job_finish() 可能直接调用下一个 device_run() */
+void gxmicro_m2m_done(struct gxmicro_jpeg_dev *gdev, struct gxmicro_m2m_ctx *ctx, uint32_t status)
+{
+	struct vb2_v4l2_buffer *src, *dst;
+	bool overflow = status & JPEG_BS_OVERFLOW;
+
+	src = v4l2_m2m_src_buf_remove(ctx->fh.m2m_ctx);
+	dst = v4l2_m2m_dst_buf_remove(ctx->fh.m2m_ctx);
+
+	if (overflow)
+		dev_dbg(gdev->dev, "m2m overflow: JPEG_BS_LEN_MAX %lu\n", vb2_plane_size(&dst->vb2_buf, 0));
+
+	v4l2_m2m_buf_copy_metadata(src, dst, true);
+	vb2_set_plane_payload(&dst->vb2_buf, 0, overflow ? 0 : ctx->fsize);
+	dst->sequence = ctx->sequence++;
+	src->sequence = dst->sequence;
+	dst->field = V4L2_FIELD_NONE;
+
+	v4l2_m2m_buf_done(src, VB2_BUF_STATE_DONE);
+	v4l2_m2m_buf_done(dst, overflow ? VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE);
+
+	v4l2_m2m_job_finish(gdev->m2m.m2m_dev, ctx->fh.m2m_ctx);
+}
+
+static void gxmicro_m2m_device_run(void *priv)
+{
+	struct gxmicro_m2m_ctx *ctx = priv;
+	struct gxmicro_jpeg_dev *gdev = ctx->gdev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	gdev->m2m.ctx = ctx;
+	if (gdev->encoding || gdev->snap.active)
+		gdev->m2m.pending = true;	/* 实时采集或快照 EOF 后执行 */
+	else
+		gxmicro_m2m_run(gdev);
+
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+static const struct v4l2_m2m_ops gxmicro_m2m_ops = {
+	.device_run = gxmicro_m2m_device_run,
+};
+
+/* ****************************** Videobuf2 Queue OPS ****************************** */
+
+static int gxmicro_m2m_queue_setup(struct vb2_queue *vbq, unsigned int *nbuffers,
+				unsigned int *nplanes, unsigned int sizes[], struct device *alloc_devs[])
+{
+	struct gxmicro_m2m_ctx *ctx = vb2_get_drv_priv(vbq);
+	uint32_t size;
+
+	if (V4L2_TYPE_IS_OUTPUT(vbq->type))
+		size = JPEG_SZ(ctx->height, JPEG_BPL(ctx->width, ctx->fmt->bpp));
+	else
+		size = ctx->sizeimage;
+
+	if (*nplanes)
+		return sizes[0] < size ? -EINVAL : 0;
+
+	*nplanes = 1;
+	sizes[0] = size;
+
+	return 0;
+}
+
+static int gxmicro_m2m_buf_prepare(struct vb2_buffer *vb)
+{
+	struct gxmicro_m2m_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+	uint32_t size;
+
+	if (V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type)) {
+		size = JPEG_SZ(ctx->height, JPEG_BPL(ctx->width, ctx->fmt->bpp));
+		if (vb2_get_plane_payload(vb, 0) < size)
+			return -EINVAL;
+	} else {
+		size = ctx->sizeimage;
+	}
+
+	if (vb2_plane_size(vb, 0) < size)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void gxmicro_m2m_buf_queue(struct vb2_buffer *vb)
+{
+	struct gxmicro_m2m_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+
+	v4l2_m2m_buf_queue(ctx->fh.m2m_ctx, to_vb2_v4l2_buffer(vb));
+}
+
+static int gxmicro_m2m_start_streaming(struct vb2_queue *vbq, unsigned int count)
+{
+	struct gxmicro_m2m_ctx *ctx = vb2_get_drv_priv(vbq);
+
+	if (V4L2_TYPE_IS_CAPTURE(vbq->type))
+		ctx->sequence = 0;
+
+	return 0;
+}
+
+static void gxmicro_m2m_stop_streaming(struct vb2_queue *vbq)
+{
+	struct gxmicro_m2m_ctx *ctx = vb2_get_drv_priv(vbq);
+	struct vb2_v4l2_buffer *vbuf;
+
+	/* v4l2_m2m_streamoff() 已等待正在执行的 job 完成 */
+	for (;;) {
+		if (V4L2_TYPE_IS_OUTPUT(vbq->type))
+			vbuf = v4l2_m2m_src_buf_remove(ctx->fh.m2m_ctx);
+		else
+			vbuf = v4l2_m2m_dst_buf_remove(ctx->fh.m2m_ctx);
+		if (!vbuf)
+			break;
+		v4l2_m2m_buf_done(vbuf, VB2_BUF_STATE_ERROR);
+	}
+}
+
+static const struct vb2_ops gxmicro_m2m_vb2_ops = {
+	.queue_setup = gxmicro_m2m_queue_setup,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+	.buf_prepare = gxmicro_m2m_buf_prepare,
+	.start_streaming = gxmicro_m2m_start_streaming,
+	.stop_streaming = gxmicro_m2m_stop_streaming,
+	.buf_queue = gxmicro_m2m_buf_queue,
+};
+
+static int gxmicro_m2m_queue_init(void *priv, struct vb2_queue *src_vq, struct vb2_queue *dst_vq)
+{
+	struct gxmicro_m2m_ctx *ctx = priv;
+	struct gxmicro_jpeg_dev *gdev = ctx->gdev;
+	int ret;
+
+	src_vq->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	src_vq->io_modes = VB2_MMAP | VB2_DMABUF;
+	src_vq->dev = gdev->dev;
+	src_vq->lock = &gdev->m2m.lock;
+	src_vq->ops = &gxmicro_m2m_vb2_ops;
+	src_vq->mem_ops = &vb2_dma_contig_memops;
+	src_vq->drv_priv = ctx;
+	src_vq->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+	src_vq->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	gxmicro_vb2_cache_hints(gdev, src_vq);	/* 用户写入原始图像 */
+
+	ret = vb2_queue_init(src_vq);
+	if (ret)
+		return ret;
+
+	dst_vq->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	dst_vq->io_modes = VB2_MMAP | VB2_DMABUF;
+	dst_vq->dev = gdev->dev;
+	dst_vq->lock = &gdev->m2m.lock;
+	dst_vq->ops = &gxmicro_m2m_vb2_ops;
+	dst_vq->mem_ops = &vb2_dma_contig_memops;
+	dst_vq->drv_priv = ctx;
+	dst_vq->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+	dst_vq->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	gxmicro_vb2_cache_hints(gdev, dst_vq);
+
+	return vb2_queue_init(dst_vq);
+}
+
+/* ****************************** Controls ****************************** */
+
+static int gxmicro_m2m_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct gxmicro_m2m_ctx *ctx = container_of(ctrl->handler, struct gxmicro_m2m_ctx, hdl);
+
+	/* 在下一个 job 启动时生效 */
+	switch (ctrl->id) {
+	case V4L2_CID_JPEG_COMPRESSION_QUALITY:
+		WRITE_ONCE(ctx->qp, ctrl->val);
+		break;
+	case V4L2_CID_JPEG_CHROMA_SUBSAMPLING:
+		WRITE_ONCE(ctx->subsampling, ctrl->val);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops gxmicro_m2m_ctrl_ops = {
+	.s_ctrl = gxmicro_m2m_s_ctrl,
+};
+
+static int gxmicro_m2m_ctrls_init(struct gxmicro_m2m_ctx *ctx)
+{
+	struct v4l2_ctrl_handler *hdl = &ctx->hdl;
+	int ret;
+
+	v4l2_ctrl_handler_init(hdl, 2);
+
+	v4l2_ctrl_new_std(hdl, &gxmicro_m2m_ctrl_ops, V4L2_CID_JPEG_COMPRESSION_QUALITY,
+			JPEG_QP_MIN, JPEG_QP_MAX, 1, JPEG_QP_DEF);
+
+	v4l2_ctrl_new_std_menu(hdl, &gxmicro_m2m_ctrl_ops, V4L2_CID_JPEG_CHROMA_SUBSAMPLING,
+			V4L2_JPEG_CHROMA_SUBSAMPLING_420, JPEG_CHROMA_SUBSAMPLING_MASK, V4L2_JPEG_CHROMA_SUBSAMPLING_444);
+
+	ret = hdl->error;
+	if (!ret)
+		ret = v4l2_ctrl_handler_setup(hdl);
+	if (ret)
+		v4l2_ctrl_handler_free(hdl);
+
+	return ret;
+}
+
+/* ****************************** V4L2 File OPS ****************************** */
+
+static void gxmicro_m2m_set_fmt(struct gxmicro_m2m_ctx *ctx, const struct gxmicro_m2m_fmt *fmt,
+				uint32_t width, uint32_t height)
+{
+	ctx->fmt = fmt;
+	ctx->width = width;
+	ctx->height = height;
+	/* QP 可在 job 之间修改, 按最小 QP 估算, 溢出时 buffer 标记 V4L2_BUF_FLAG_ERROR */
+	ctx->sizeimage = gxmicro_jpeg_bs_estimate(width, height, V4L2_JPEG_CHROMA_SUBSAMPLING_444, JPEG_QP_MIN);
+}
+
+static int gxmicro_m2m_open(struct file *file)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct gxmicro_m2m_ctx *ctx;
+	int ret;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (mutex_lock_interruptible(&gdev->m2m.lock)) {
+		kfree(ctx);
+		return -ERESTARTSYS;
+	}
+
+	ctx->gdev = gdev;
+	gxmicro_m2m_set_fmt(ctx, &gxmicro_m2m_fmts[0], JPEG_MAX_WIDTH, JPEG_MAX_HEIGHT);
+
+	v4l2_fh_init(&ctx->fh, video_devdata(file));
+	file->private_data = &ctx->fh;
+
+	ret = gxmicro_m2m_ctrls_init(ctx);
+	if (ret)
+		goto err_ctrls_init;
+	ctx->fh.ctrl_handler = &ctx->hdl;
+
+	ctx->fh.m2m_ctx = v4l2_m2m_ctx_init(gdev->m2m.m2m_dev, ctx, gxmicro_m2m_queue_init);
+	if (IS_ERR(ctx->fh.m2m_ctx)) {
+		ret = PTR_ERR(ctx->fh.m2m_ctx);
+		goto err_m2m_ctx_init;
+	}
+
+	v4l2_fh_add(&ctx->fh);
+
+	mutex_unlock(&gdev->m2m.lock);
+
+	return 0;
+
+err_m2m_ctx_init:
+	v4l2_ctrl_handler_free(&ctx->hdl);
+err_ctrls_init:
+	v4l2_fh_exit(&ctx->fh);
+	mutex_unlock(&gdev->m2m.lock);
+	kfree(ctx);
+	return ret;
+}
+
+static int gxmicro_m2m_release(struct file *file)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct gxmicro_m2m_ctx *ctx = fh_to_gxmicro_m2m_ctx(file->private_data);
+
+	mutex_lock(&gdev->m2m.lock);
+	v4l2_m2m_ctx_release(ctx->fh.m2m_ctx);
+	mutex_unlock(&gdev->m2m.lock);
+
+	v4l2_fh_del(&ctx->fh);
+	v4l2_fh_exit(&ctx->fh);
+	v4l2_ctrl_handler_free(&ctx->hdl);
+	kfree(ctx);
+
+	return 0;
+}
+
+static const struct v4l2_file_operations gxmicro_m2m_fops = {
+	.owner = THIS_MODULE,
+	.poll = v4l2_m2m_fop_poll,
+	.unlocked_ioctl = video_ioctl2,
+	.mmap = v4l2_m2m_fop_mmap,
+	.open = gxmicro_m2m_open,
+	.release = gxmicro_m2m_release,
+};
+
+/* ****************************** V4L2 ioctl ****************************** */
+
+static int gxmicro_m2m_querycap(struct file *file, void *fh, struct v4l2_capability *cap)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+
+	strscpy(cap->driver, DRVNAME, sizeof(cap->driver));
+	strscpy(cap->card, M2M_INFO, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform: %s", dev_name(gdev->dev));
+
+	return 0;
+}
+
+static int gxmicro_m2m_enum_fmt_vid_cap(struct file *file, void *fh, struct v4l2_fmtdesc *f)
+{
+	if (f->index)
+		return -EINVAL;
+
+	f->pixelformat = V4L2_PIX_FMT_JPEG;
+
+	return 0;
+}
+
+static int gxmicro_m2m_enum_fmt_vid_out(struct file *file, void *fh, struct v4l2_fmtdesc *f)
+{
+	if (f->index >= ARRAY_SIZE(gxmicro_m2m_fmts))
+		return -EINVAL;
+
+	f->pixelformat = gxmicro_m2m_fmts[f->index].fourcc;
+
+	return 0;
+}
+
+static int gxmicro_m2m_g_fmt_vid_cap(struct file *file, void *fh, struct v4l2_format *f)
+{
+	struct gxmicro_m2m_ctx *ctx = fh_to_gxmicro_m2m_ctx(fh);
+
+	f->fmt.pix.width = ctx->width;
+	f->fmt.pix.height = ctx->height;
+	f->fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
+	f->fmt.pix.field = V4L2_FIELD_NONE;
+	f->fmt.pix.bytesperline = 0;
+	f->fmt.pix.sizeimage = ctx->sizeimage;
+	f->fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+	f->fmt.pix.flags = 0;
+	f->fmt.pix.ycbcr_enc = V4L2_YCBCR_ENC_601;
+	f->fmt.pix.quantization = V4L2_QUANTIZATION_FULL_RANGE;
+	f->fmt.pix.xfer_func = V4L2_XFER_FUNC_SRGB;
+
+	return 0;
+}
+
+static int gxmicro_m2m_g_fmt_vid_out(struct file *file, void *fh, struct v4l2_format *f)
+{
+	struct gxmicro_m2m_ctx *ctx = fh_to_gxmicro_m2m_ctx(fh);
+	uint32_t bpl = JPEG_BPL(ctx->width, ctx->fmt->bpp);
+
+	f->fmt.pix.width = ctx->width;
+	f->fmt.pix.height = ctx->height;
+	f->fmt.pix.pixelformat = ctx->fmt->fourcc;
+	f->fmt.pix.field = V4L2_FIELD_NONE;
+	f->fmt.pix.bytesperline = bpl;
+	f->fmt.pix.sizeimage = JPEG_SZ(ctx->height, bpl);
+	f->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+	f->fmt.pix.flags = 0;
+	f->fmt.pix.ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+	f->fmt.pix.quantization = V4L2_QUANTIZATION_DEFAULT;
+	f->fmt.pix.xfer_func = V4L2_XFER_FUNC_DEFAULT;
+
+	return 0;
+}
+
+/* 编码器没有 stride 寄存器, bytesperline 固定为 width * bpp / 8 */
+static int gxmicro_m2m_try_fmt_vid_out(struct file *file, void *fh, struct v4l2_format *f)
+{
+	const struct gxmicro_m2m_fmt *fmt;
+	uint32_t bpl;
+
+	fmt = gxmicro_m2m_find_fmt(f->fmt.pix.pixelformat);
+	if (!fmt)
+		fmt = &gxmicro_m2m_fmts[0];
+
+	f->fmt.pix.width = clamp_t(uint32_t, f->fmt.pix.width, JPEG_MIN_WIDTH, JPEG_MAX_WIDTH);
+	f->fmt.pix.height = clamp_t(uint32_t, f->fmt.pix.height, JPEG_MIN_HEIGHT, JPEG_MAX_HEIGHT);
+	bpl = JPEG_BPL(f->fmt.pix.width, fmt->bpp);
+
+	f->fmt.pix.pixelformat = fmt->fourcc;
+	f->fmt.pix.field = V4L2_FIELD_NONE;
+	f->fmt.pix.bytesperline = bpl;
+	f->fmt.pix.sizeimage = JPEG_SZ(f->fmt.pix.height, bpl);
+	f->fmt.pix.flags = 0;
+	if (f->fmt.pix.colorspace == V4L2_COLORSPACE_DEFAULT)
+		f->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+
+	return 0;
+}
+
+static int gxmicro_m2m_s_fmt_vid_out(struct file *file, void *fh, struct v4l2_format *f)
+{
+	struct gxmicro_m2m_ctx *ctx = fh_to_gxmicro_m2m_ctx(fh);
+	int ret;
+
+	ret = gxmicro_m2m_try_fmt_vid_out(file, fh, f);
+	if (ret)
+		return ret;
+
+	/* CAPTURE 的 sizeimage 由 OUTPUT 宽高决定 */
+	if (vb2_is_busy(v4l2_m2m_get_vq(ctx->fh.m2m_ctx, V4L2_BUF_TYPE_VIDEO_OUTPUT)) ||
+	    vb2_is_busy(v4l2_m2m_get_vq(ctx->fh.m2m_ctx, V4L2_BUF_TYPE_VIDEO_CAPTURE)))
+		return -EBUSY;
+
+	gxmicro_m2m_set_fmt(ctx, gxmicro_m2m_find_fmt(f->fmt.pix.pixelformat),
+			    f->fmt.pix.width, f->fmt.pix.height);
+
+	return 0;
+}
+
+/* CAPTURE 格式跟随 OUTPUT */
+static int gxmicro_m2m_try_fmt_vid_cap(struct file *file, void *fh, struct v4l2_format *f)
+{
+	return gxmicro_m2m_g_fmt_vid_cap(file, fh, f);
+}
+
+static const struct v4l2_ioctl_ops gxmicro_m2m_ioctl_ops = {
+
+	/* VIDIOC */
+	.vidioc_querycap = gxmicro_m2m_querycap,
+	.vidioc_enum_fmt_vid_cap = gxmicro_m2m_enum_fmt_vid_cap,
+	.vidioc_g_fmt_vid_cap = gxmicro_m2m_g_fmt_vid_cap,
+	.vidioc_s_fmt_vid_cap = gxmicro_m2m_try_fmt_vid_cap,
+	.vidioc_try_fmt_vid_cap = gxmicro_m2m_try_fmt_vid_cap,
+	.vidioc_enum_fmt_vid_out = gxmicro_m2m_enum_fmt_vid_out,
+	.vidioc_g_fmt_vid_out = gxmicro_m2m_g_fmt_vid_out,
+	.vidioc_s_fmt_vid_out = gxmicro_m2m_s_fmt_vid_out,
+	.vidioc_try_fmt_vid_out = gxmicro_m2m_try_fmt_vid_out,
+
+	/* Videobuffer */
+	.vidioc_reqbufs = v4l2_m2m_ioctl_reqbufs,
+	.vidioc_querybuf = v4l2_m2m_ioctl_querybuf,
+	.vidioc_qbuf = v4l2_m2m_ioctl_qbuf,
+	.vidioc_expbuf = v4l2_m2m_ioctl_expbuf,
+	.vidioc_dqbuf = v4l2_m2m_ioctl_dqbuf,
+	.vidioc_create_bufs = v4l2_m2m_ioctl_create_bufs,
+	.vidioc_prepare_buf = v4l2_m2m_ioctl_prepare_buf,
+
+	/* Stream */
+	.vidioc_streamon = v4l2_m2m_ioctl_streamon,
+	.vidioc_streamoff = v4l2_m2m_ioctl_streamoff,
+
+	/* Event */
+	.vidioc_subscribe_event = v4l2_ctrl_subscribe_event,
+	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
+};
+
+/* ****************************** M2M Init & Fini ****************************** */
+
+int gxmicro_m2m_init(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_m2m *m2m = &gdev->m2m;
+	struct video_device *vdev = &m2m->vdev;
+	int ret;
+
+	mutex_init(&m2m->lock);
+
+	m2m->m2m_dev = v4l2_m2m_init(&gxmicro_m2m_ops);
+	if (IS_ERR(m2m->m2m_dev)) {
+		dev_err(gdev->dev, "Failed to init mem2mem device\n");
+		return PTR_ERR(m2m->m2m_dev);
+	}
+
+	vdev->fops = &gxmicro_m2m_fops;
+	vdev->device_caps = V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING;
+	vdev->v4l2_dev = &gdev->v4l2;
+	strscpy(vdev->name, M2M_INFO, sizeof(vdev->name));
+	vdev->vfl_dir = VFL_DIR_M2M;
+	vdev->release = video_device_release_empty;
+	vdev->ioctl_ops = &gxmicro_m2m_ioctl_ops;
+	vdev->lock = &m2m->lock;
+
+	video_set_drvdata(vdev, gdev);
+
+	ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
+	if (ret) {
+		dev_err(gdev->dev, "Failed to register M2M device\n");
+		goto err_register;
+	}
+
+	return 0;
+
+err_register:
+	v4l2_m2m_release(m2m->m2m_dev);
+	return ret;
+}
+
+void gxmicro_m2m_fini(struct gxmicro_jpeg_dev *gdev)
+{
+	video_unregister_device(&gdev->m2m.vdev);
+	v4l2_m2m_release(gdev->m2m.m2m_dev);
+}
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro V4L2 Metadata Capture
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/bitmap.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-vmalloc.h>
+#include <media/v4l2-ioctl.h>
+
+#include "gxmicro_jpeg.h"
+
+#define META_INFO	"GXMicro JPEG Tiles"
+
+/*
+ * 每帧 JPEG 对应一个 struct gxmicro_jpeg_meta, 包含与上一帧相比变化的 tile 与该帧的编码统计.
+ * tile 在 start_work 中启动编码前计算并累加 (gxmicro_meta_stage), 在硬中断分配 sequence 时输出 (gxmicro_meta_done).
+ * V4L2_CID_GXMICRO_META_TILES 为 0 时不计算哈希, 编码不经过 start_work, 记录只有编码统计 (GXMICRO_META_FLAG_FULL).
+ * 没有空闲的 meta buffer 时丢弃该帧的记录, 用户可根据 sequence 不连续发现, 其变化的 tile 并入下一条记录.
+ * irq thread 完成的帧在重复帧检测后才输出记录, 以便标记 GXMICRO_META_FLAG_REPEAT.
+ */
+
+struct gxmicro_meta_buffer {
+	struct vb2_v4l2_buffer vbuf;
+	struct list_head list;
+};
+#define vbuf_to_gxmicro_meta_buffer(vbuf)	container_of(vbuf, struct gxmicro_meta_buffer, vbuf)
+
+/*
+ * gdev->buf_lock spinlock must be held by caller
+ *
+ * 每次启动编码前调用, 哈希基准已前移: 变化的 tile 累加到下一条输出的记录,
+ * 记录因没有 meta buffer 被丢弃或该帧未启动编码时不会丢失. valid 为 false: 未计算哈希或无法访问源图像.
+ */
+void gxmicro_meta_stage(struct gxmicro_jpeg_dev *gdev, bool valid)
+{
+	struct gxmicro_meta *meta = &gdev->meta;
+	struct gxmicro_tile *tile = &gdev->tile;
+
+	/* 下一条记录视为全部变化 */
+	if (!valid) {
+		meta->full = true;
+		return;
+	}
+
+	meta->tiles_x = tile->tiles_x;
+	meta->tiles_y = tile->tiles_y;
+	bitmap_or(meta->dirty, meta->dirty, tile->dirty, JPEG_TILES_MAX);
+	meta->pending = true;
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 记录输出后重新累加 */
+static void gxmicro_meta_reset(struct gxmicro_meta *meta)
+{
+	meta->pending = false;
+	meta->full = false;
+	bitmap_zero(meta->dirty, JPEG_TILES_MAX);
+}
+
+/*
+ * gdev->buf_lock spinlock must be held by caller, 硬中断中调用, overflow 重新编码结束后
+ *
+ * hold: 该帧由 irq thread 完成, 记录在重复帧检测后由 gxmicro_meta_release() 输出.
+ */
+void gxmicro_meta_done(struct gxmicro_jpeg_dev *gdev, uint32_t sequence, uint32_t qp,
+		       uint32_t retries, bool overflow, uint64_t encode_ns, bool hold)
+{
+	struct gxmicro_meta *meta = &gdev->meta;
+	struct gxmicro_meta_buffer *mbuf;
+	struct gxmicro_jpeg_meta *m;
+	DECLARE_BITMAP(full, JPEG_TILES_MAX);
+	uint32_t tiles;
+
+	/* 丢弃该帧的记录, 变化的 tile 保留到下一条记录 */
+	mbuf = list_first_entry_or_null(&meta->buffers, struct gxmicro_meta_buffer, list);
+	if (!mbuf)
+		return;
+
+	list_del(&mbuf->list);
+
+	m = vb2_plane_vaddr(&mbuf->vbuf.vb2_buf, 0);
+	memset(m, 0, sizeof(*m));
+	m->sequence = sequence;
+	m->tile_size = JPEG_TILE_SIZE;
+	m->qp = qp;
+	m->retries = retries;
+	m->encode_us = div_u64(encode_ns, NSEC_PER_USEC);
+	m->bytesused = overflow ? 0 : gxmicro_read(gdev, JPEG_BS_LENGTH);
+	if (overflow)
+		m->flags |= GXMICRO_META_FLAG_OVERFLOW;
+
+	if (meta->pending && !meta->full) {
+		m->tiles_x = meta->tiles_x;
+		m->tiles_y = meta->tiles_y;
+		bitmap_to_arr32(m->dirty, meta->dirty, meta->tiles_x * meta->tiles_y);
+	} else {
+		m->flags |= GXMICRO_META_FLAG_FULL;
+		m->tiles_x = DIV_ROUND_UP(gdev->fmt.width, JPEG_TILE_SIZE);
+		m->tiles_y = DIV_ROUND_UP(gdev->fmt.height, JPEG_TILE_SIZE);
+		tiles = min_t(uint32_t, m->tiles_x * m->tiles_y, JPEG_TILES_MAX);
+		bitmap_fill(full, tiles);
+		bitmap_to_arr32(m->dirty, full, tiles);
+	}
+
+	vb2_set_plane_payload(&mbuf->vbuf.vb2_buf, 0, sizeof(*m));
+	mbuf->vbuf.vb2_buf.timestamp = ktime_get_ns();
+	mbuf->vbuf.sequence = sequence;
+	mbuf->vbuf.field = V4L2_FIELD_NONE;
+
+	gxmicro_meta_reset(meta);
+
+	if (hold) {
+		list_add_tail(&mbuf->list, &meta->held);
+		return;
+	}
+
+	vb2_buffer_done(&mbuf->vbuf.vb2_buf, VB2_BUF_STATE_DONE);
+}
+
+/*
+ * gdev->buf_lock spinlock must be held by caller
+ *
+ * irq thread 完成重复帧检测后调用, 输出 sequence 及之前的记录; 该帧的记录已丢弃时只输出之前的记录.
+ * pipeline 模式下后续帧的记录可能已在 held 中, 保留到这些帧检测完成.
+ */
+void gxmicro_meta_release(struct gxmicro_jpeg_dev *gdev, uint32_t sequence, bool repeat)
+{
+	struct gxmicro_meta_buffer *mbuf, *tmp;
+	struct gxmicro_jpeg_meta *m;
+
+	list_for_each_entry_safe(mbuf, tmp, &gdev->meta.held, list) {
+		if ((int32_t)(mbuf->vbuf.sequence - sequence) > 0)
+			break;
+
+		if (mbuf->vbuf.sequence == sequence && repeat) {
+			m = vb2_plane_vaddr(&mbuf->vbuf.vb2_buf, 0);
+			m->flags |= GXMICRO_META_FLAG_REPEAT;
+		}
+
+		list_del(&mbuf->list);
+		vb2_buffer_done(&mbuf->vbuf.vb2_buf, VB2_BUF_STATE_DONE);
+	}
+}
+
+/* gdev->buf_lock spinlock must be held by caller, capture 队列 STREAMOFF 时输出未检测的记录 */
+void gxmicro_meta_flush(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_meta_buffer *mbuf;
+
+	list_for_each_entry(mbuf, &gdev->meta.held, list)
+		vb2_buffer_done(&mbuf->vbuf.vb2_buf, VB2_BUF_STATE_DONE);
+	INIT_LIST_HEAD(&gdev->meta.held);
+}
+
+/* ****************************** Videobuf2 Queue OPS ****************************** */
+
+static int gxmicro_meta_queue_setup(struct vb2_queue *vbq, unsigned int *nbuffers,
+				unsigned int *nplanes, unsigned int sizes[], struct device *alloc_devs[])
+{
+	if (*nplanes)
+		return sizes[0] < sizeof(struct gxmicro_jpeg_meta) ? -EINVAL : 0;
+
+	*nplanes = 1;
+	sizes[0] = sizeof(struct gxmicro_jpeg_meta);
+
+	return 0;
+}
+
+static int gxmicro_meta_buf_prepare(struct vb2_buffer *vb)
+{
+	if (vb2_plane_size(vb, 0) < sizeof(struct gxmicro_jpeg_meta))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int gxmicro_meta_start_streaming(struct vb2_queue *vbq, unsigned int count)
+{
+	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vbq);
+	struct gxmicro_meta *meta = &gdev->meta;
+	unsigned long flags;
+
+	/* 第一条记录没有上一帧可比较, 下一次启动编码前开始计算 tile */
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	gxmicro_meta_reset(meta);
+	meta->full = true;
+	WRITE_ONCE(meta->streaming, true);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	return 0;
+}
+
+static void gxmicro_meta_stop_streaming(struct vb2_queue *vbq)
+{
+	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vbq);
+	struct gxmicro_meta *meta = &gdev->meta;
+	struct gxmicro_meta_buffer *mbuf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	WRITE_ONCE(meta->streaming, false);
+	gxmicro_meta_reset(meta);
+	list_for_each_entry(mbuf, &meta->buffers, list)
+		vb2_buffer_done(&mbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+	INIT_LIST_HEAD(&meta->buffers);
+	list_for_each_entry(mbuf, &meta->held, list)
+		vb2_buffer_done(&mbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+	INIT_LIST_HEAD(&meta->held);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+static void gxmicro_meta_buf_queue(struct vb2_buffer *vb)
+{
+	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vb->vb2_queue);
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct gxmicro_meta_buffer *mbuf = vbuf_to_gxmicro_meta_buffer(vbuf);
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	list_add_tail(&mbuf->list, &gdev->meta.buffers);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+static const struct vb2_ops gxmicro_meta_vb2_ops = {
+	.queue_setup = gxmicro_meta_queue_setup,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+	.buf_prepare = gxmicro_meta_buf_prepare,
+	.start_streaming = gxmicro_meta_start_streaming,
+	.stop_streaming = gxmicro_meta_stop_streaming,
+	.buf_queue = gxmicro_meta_buf_queue,
+};
+
+/* ****************************** V4L2 File OPS ****************************** */
+
+static const struct v4l2_file_operations gxmicro_meta_fops = {
+	.owner = THIS_MODULE,
+	.poll = vb2_fop_poll,
+	.unlocked_ioctl = video_ioctl2,
+	.mmap = vb2_fop_mmap,
+	.open = v4l2_fh_open,
+	.release = vb2_fop_release,
+};
+
+/* ****************************** V4L2 ioctl ****************************** */
+
+static int gxmicro_meta_querycap(struct file *file, void *fh, struct v4l2_capability *cap)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+
+	strscpy(cap->driver, DRVNAME, sizeof(cap->driver));
+	strscpy(cap->card, META_INFO, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform: %s", dev_name(gdev->dev));
+
+	return 0;
+}
+
+static int gxmicro_meta_enum_fmt(struct file *file, void *fh, struct v4l2_fmtdesc *f)
+{
+	if (f->index)
+		return -EINVAL;
+
+	f->pixelformat = V4L2_META_FMT_GXMICRO_TILES;
+
+	return 0;
+}
+
+/* 格式固定, S_FMT 与 TRY_FMT 返回当前格式 */
+static int gxmicro_meta_g_fmt(struct file *file, void *fh, struct v4l2_format *f)
+{
+	f->fmt.meta.dataformat = V4L2_META_FMT_GXMICRO_TILES;
+	f->fmt.meta.buffersize = sizeof(struct gxmicro_jpeg_meta);
+
+	return 0;
+}
+
+static const struct v4l2_ioctl_ops gxmicro_meta_ioctl_ops = {
+
+	/* VIDIOC */
+	.vidioc_querycap = gxmicro_meta_querycap,
+	.vidioc_enum_fmt_meta_cap = gxmicro_meta_enum_fmt,
+	.vidioc_g_fmt_meta_cap = gxmicro_meta_g_fmt,
+	.vidioc_s_fmt_meta_cap = gxmicro_meta_g_fmt,
+	.vidioc_try_fmt_meta_cap = gxmicro_meta_g_fmt,
+
+	/* Videobuffer */
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+
+	/* Stream */
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+};
+
+/* ****************************** Meta Init & Fini ****************************** */
+
+int gxmicro_meta_init(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_meta *meta = &gdev->meta;
+	struct vb2_queue *vbq = &meta->vbq;
+	struct video_device *vdev = &meta->vdev;
+	int ret;
+
+	BUILD_BUG_ON(JPEG_TILES_MAX > GXMICRO_META_TILES_MAX);
+
+	mutex_init(&meta->lock);
+	INIT_LIST_HEAD(&meta->buffers);
+	INIT_LIST_HEAD(&meta->held);
+
+	vbq->type = V4L2_BUF_TYPE_META_CAPTURE;
+	vbq->io_modes = VB2_MMAP | VB2_DMABUF;
+	vbq->dev = gdev->dev;
+	vbq->lock = &meta->lock;
+	vbq->ops = &gxmicro_meta_vb2_ops;
+	vbq->mem_ops = &vb2_vmalloc_memops;
+	vbq->drv_priv = gdev;
+	vbq->buf_struct_size = sizeof(struct gxmicro_meta_buffer);
+	vbq->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+
+	ret = vb2_queue_init(vbq);
+	if (ret) {
+		dev_err(gdev->dev, "Failed to init meta vb2 queue\n");
+		return ret;
+	}
+
+	vdev->fops = &gxmicro_meta_fops;
+	vdev->device_caps = V4L2_CAP_META_CAPTURE | V4L2_CAP_STREAMING;
+	vdev->v4l2_dev = &gdev->v4l2;
+	vdev->queue = vbq;
+	strscpy(vdev->name, META_INFO, sizeof(vdev->name));
+	vdev->vfl_dir = VFL_DIR_RX;
+	vdev->release = video_device_release_empty;
+	vdev->ioctl_ops = &gxmicro_meta_ioctl_ops;
+	vdev->lock = &meta->lock;
+
+	video_set_drvdata(vdev, gdev);
+
+	ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
+	if (ret) {
+		dev_err(gdev->dev, "Failed to register Meta device\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+void gxmicro_meta_fini(struct gxmicro_jpeg_dev *gdev)
+{
+	vb2_video_unregister_device(&gdev->meta.vdev);
+}
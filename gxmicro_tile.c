@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro JPEG Framebuffer Tiles
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/module.h>
+#include <linux/io.h>
+#include <linux/dma-map-ops.h>
+#include <linux/xxhash.h>
+
+#include "gxmicro_jpeg.h"
+
+/*
+ * 将 JPEG_FB_BASE 的源图像按 JPEG_TILE_SIZE x JPEG_TILE_SIZE 分块, 每块计算 xxh64,
+ * 与上一帧比较得到变化的 tile.
+ * xxh64 每轮并行处理 4 个 64 bit lane, 内核中不使用 SIMD 寄存器 (kernel_neon_begin),
+ * 速度受限于源图像的读取: cached 映射时每帧哈希全部行; uncached 映射时 1080p 整帧约 8 MB 逐字读取,
+ * 每帧只哈希 1 / stride 的行 (y % stride == phase, phase 逐帧轮换), 与 stride 帧前相同 phase 的结果比较:
+ * 	只改动未采样行的变化最多延迟 stride - 1 帧才被检测到, 变化后最多 stride 帧内该 tile 持续标记为变化.
+ * 每帧耗时见 debugfs stats 的 tile hash 直方图.
+ */
+
+static unsigned int tile_stride;
+module_param(tile_stride, uint, 0644);
+MODULE_PARM_DESC(tile_stride, "Hash every Nth framebuffer row per frame, applied at STREAMON, 0: 1 if DMA coherent else 4 (default 0, max 4)");
+
+static int gxmicro_tile_map(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_tile *tile = &gdev->tile;
+	struct gxmicro_format fmt;
+	uint32_t base, stride;
+	bool coherent;
+
+	/* m2m job 执行期间 JPEG_FB_BASE 为 job 的原始图像 */
+	base = gxmicro_source_base(gdev);
+	if (!base)
+		return -ENODEV;
+
+	gxmicro_format_get(gdev, &fmt);
+	tile->width = fmt.width;
+	tile->height = fmt.height;
+	if (!tile->width || tile->width > JPEG_MAX_WIDTH || !tile->height || tile->height > JPEG_MAX_HEIGHT)
+		return -EINVAL;
+
+	if (!fmt.bpp)
+		return -EINVAL;
+
+	tile->cpp = fmt.bpp / BITS_PER_BYTE;
+	tile->bpl = fmt.bpl;
+	tile->size = JPEG_SZ(tile->height, tile->bpl);
+	tile->tiles_x = DIV_ROUND_UP(tile->width, JPEG_TILE_SIZE);
+	tile->tiles_y = DIV_ROUND_UP(tile->height, JPEG_TILE_SIZE);
+	tile->valid = 0;
+	tile->phase = 0;
+
+	/*
+	 * framebuffer 属于显示控制器, 由其 DMA 写入:
+	 * 	DMA coherent 平台 cache 由硬件维护, 以 write-back 映射 (System RAM 时为线性映射);
+	 * 	否则没有对该内存的 cache 维护接口 (不是本设备的 streaming DMA), 以 write-combine 映射,
+	 * 	memremap(WC) 不接受 System RAM, 此时返回 -ENOMEM, 不检测变化.
+	 */
+	coherent = dev_is_dma_coherent(gdev->dev);
+	tile->vaddr = memremap(base, tile->size, coherent ? MEMREMAP_WB : MEMREMAP_WC);
+	if (!tile->vaddr)
+		return -ENOMEM;
+
+	stride = READ_ONCE(tile_stride);
+	if (!stride)
+		stride = coherent ? 1 : JPEG_TILE_STRIDE_MAX;
+	tile->stride = min_t(uint32_t, stride, JPEG_TILE_STRIDE_MAX);
+
+	return 0;
+}
+
+void gxmicro_tile_unmap(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_tile *tile = &gdev->tile;
+
+	if (!tile->vaddr)
+		return;
+
+	memunmap(tile->vaddr);
+	tile->vaddr = NULL;
+	tile->valid = 0;
+}
+
+/* 返回 1: 有 tile 变化; 0: 与上一帧相同; < 0: 无法访问源图像. 可睡眠 */
+int gxmicro_tile_update(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_tile *tile = &gdev->tile;
+	struct gxmicro_format fmt;
+	const uint8_t *line;
+	uint32_t x, y, tx, row, seg, i, tiles, phase;
+	int ret;
+
+	/* 源分辨率或格式变化后重新映射 */
+	gxmicro_format_get(gdev, &fmt);
+	if (tile->vaddr && (tile->width != fmt.width || tile->height != fmt.height || tile->bpl != fmt.bpl))
+		gxmicro_tile_unmap(gdev);
+
+	if (!tile->vaddr) {
+		ret = gxmicro_tile_map(gdev);
+		if (ret)
+			return ret;
+	}
+
+	tiles = tile->tiles_x * tile->tiles_y;
+	memset(tile->cur, 0, tiles * sizeof(tile->cur[0]));
+	phase = tile->phase;
+
+	/* 逐行访问, 每行按 tile 宽度分段累加到对应 tile 的哈希中 */
+	for (y = phase; y < tile->height; y += tile->stride) {
+		line = tile->vaddr + y * tile->bpl;
+		row = (y / JPEG_TILE_SIZE) * tile->tiles_x;
+
+		for (tx = 0; tx < tile->tiles_x; tx++) {
+			x = tx * JPEG_TILE_SIZE;
+			seg = min_t(uint32_t, JPEG_TILE_SIZE, tile->width - x) * tile->cpp;
+			tile->cur[row + tx] = xxh64(line + x * tile->cpp, seg, tile->cur[row + tx]);
+		}
+	}
+
+	for (i = 0; i < tiles; i++) {
+		if (!(tile->valid & BIT(phase)) || tile->cur[i] != tile->hash[phase][i])
+			__set_bit(i, tile->dirty);
+		else
+			__clear_bit(i, tile->dirty);
+		tile->hash[phase][i] = tile->cur[i];
+	}
+	tile->valid |= BIT(phase);
+	tile->phase = (phase + 1) % tile->stride;
+
+	return !bitmap_empty(tile->dirty, tiles);
+}
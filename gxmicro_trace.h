@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * GXMicro JPEG Tracepoints
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gxmicro_jpeg
+
+#if !defined(__GXMICRO_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __GXMICRO_TRACE_H__
+
+#include <linux/types.h>
+#include <linux/timekeeping.h>
+#include <linux/tracepoint.h>
+#include <linux/v4l2-controls.h>
+
+/*
+ * 每帧: gxmicro_jpeg_start -> gxmicro_jpeg_irq -> gxmicro_jpeg_done -> gxmicro_jpeg_dqbuf
+ * 	start -> irq: 编码时间
+ * 	irq -> done: irq thread 调度延迟 (pipeline)
+ * 	done -> dqbuf: 用户取帧延迟, dqbuf 的 delay_ns 为 EOF timestamp 到 DQBUF
+ */
+
+/* TP_printk 中的枚举值导出给 perf / trace-cmd 解析 */
+TRACE_DEFINE_ENUM(V4L2_JPEG_CHROMA_SUBSAMPLING_444);
+TRACE_DEFINE_ENUM(V4L2_JPEG_CHROMA_SUBSAMPLING_420);
+
+#define show_subsampling(s)						\
+	__print_symbolic(s,						\
+			 { V4L2_JPEG_CHROMA_SUBSAMPLING_444, "444" },	\
+			 { V4L2_JPEG_CHROMA_SUBSAMPLING_420, "420" })
+
+TRACE_EVENT(gxmicro_jpeg_start,
+	TP_PROTO(unsigned int index, uint32_t qp, uint32_t subsampling, uint32_t retries),
+	TP_ARGS(index, qp, subsampling, retries),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(uint32_t, qp)
+		__field(uint32_t, subsampling)
+		__field(uint32_t, retries)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->qp = qp;
+		__entry->subsampling = subsampling;
+		__entry->retries = retries;
+	),
+
+	TP_printk("index=%u qp=%u subsampling=%s retries=%u",
+		  __entry->index, __entry->qp,
+		  show_subsampling(__entry->subsampling),
+		  __entry->retries)
+);
+
+TRACE_EVENT(gxmicro_jpeg_irq,
+	TP_PROTO(uint32_t status),
+	TP_ARGS(status),
+
+	TP_STRUCT__entry(
+		__field(uint32_t, status)
+	),
+
+	TP_fast_assign(
+		__entry->status = status;
+	),
+
+	TP_printk("status=0x%04x%s%s", __entry->status,
+		  __entry->status & JPEG_EOF ? " EOF" : "",
+		  __entry->status & JPEG_BS_OVERFLOW ? " BS_OVERFLOW" : "")
+);
+
+TRACE_EVENT(gxmicro_jpeg_done,
+	TP_PROTO(unsigned int index, uint32_t sequence, uint32_t length, bool error),
+	TP_ARGS(index, sequence, length, error),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(uint32_t, sequence)
+		__field(uint32_t, length)
+		__field(bool, error)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->sequence = sequence;
+		__entry->length = length;
+		__entry->error = error;
+	),
+
+	TP_printk("index=%u sequence=%u length=%u%s",
+		  __entry->index, __entry->sequence, __entry->length, __entry->error ? " error" : "")
+);
+
+TRACE_EVENT(gxmicro_jpeg_dqbuf,
+	TP_PROTO(unsigned int index, uint32_t sequence, uint64_t timestamp),
+	TP_ARGS(index, sequence, timestamp),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(uint32_t, sequence)
+		__field(uint64_t, delay_ns)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->sequence = sequence;
+		__entry->delay_ns = ktime_get_ns() - timestamp;
+	),
+
+	TP_printk("index=%u sequence=%u delay_ns=%llu",
+		  __entry->index, __entry->sequence, __entry->delay_ns)
+);
+
+/* CBR: 每帧完成后根据 JPEG_BS_LENGTH 调整的下一帧 QP */
+TRACE_EVENT(gxmicro_jpeg_rc,
+	TP_PROTO(uint32_t size, uint32_t target, uint32_t qp),
+	TP_ARGS(size, target, qp),
+
+	TP_STRUCT__entry(
+		__field(uint32_t, size)
+		__field(uint32_t, target)
+		__field(uint32_t, qp)
+	),
+
+	TP_fast_assign(
+		__entry->size = size;
+		__entry->target = target;
+		__entry->qp = qp;
+	),
+
+	TP_printk("size=%u target=%u qp=%u", __entry->size, __entry->target, __entry->qp)
+);
+
+TRACE_EVENT(gxmicro_jpeg_stop,
+	TP_PROTO(bool encoding, uint32_t sequence),
+	TP_ARGS(encoding, sequence),
+
+	TP_STRUCT__entry(
+		__field(bool, encoding)
+		__field(uint32_t, sequence)
+	),
+
+	TP_fast_assign(
+		__entry->encoding = encoding;
+		__entry->sequence = sequence;
+	),
+
+	TP_printk("encoding=%d frames=%u", __entry->encoding, __entry->sequence)
+);
+
+#endif /* __GXMICRO_TRACE_H__ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gxmicro_trace
+#include <trace/define_trace.h>
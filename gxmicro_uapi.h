@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * GXMicro JPEG Controller UAPI
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#ifndef __GXMICRO_UAPI_H__
+#define __GXMICRO_UAPI_H__
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+#include <linux/v4l2-controls.h>
+
+/* ****************************** Controls ****************************** */
+
+#define V4L2_CID_GXMICRO_BASE		(V4L2_CID_USER_BASE + 0x1f00)
+#define V4L2_CID_GXMICRO_RC_GAIN	(V4L2_CID_GXMICRO_BASE + 0)	/* 码率控制增益, 单位 1/16 */
+#define V4L2_CID_GXMICRO_QP		(V4L2_CID_GXMICRO_BASE + 1)	/* 当前 JPEG_ENC_QP, 只读 */
+#define V4L2_CID_GXMICRO_OVERFLOWS	(V4L2_CID_GXMICRO_BASE + 2)	/* JPEG_BS_OVERFLOW 次数, 只读 */
+#define V4L2_CID_GXMICRO_RETRIES	(V4L2_CID_GXMICRO_BASE + 3)	/* overflow 后重新编码次数, 只读 */
+#define V4L2_CID_GXMICRO_LOW_LATENCY	(V4L2_CID_GXMICRO_BASE + 4)	/* 最新帧优先, 丢弃中间帧 */
+#define V4L2_CID_GXMICRO_SKIP_UNCHANGED	(V4L2_CID_GXMICRO_BASE + 5)	/* 源图像未变化时跳过编码 */
+#define V4L2_CID_GXMICRO_SKIPS		(V4L2_CID_GXMICRO_BASE + 6)	/* 跳过编码次数, 只读 */
+#define V4L2_CID_GXMICRO_DUP_MODE	(V4L2_CID_GXMICRO_BASE + 7)	/* enum gxmicro_dup_mode */
+#define V4L2_CID_GXMICRO_DUP_KEEPALIVE	(V4L2_CID_GXMICRO_BASE + 8)	/* 重复帧最少输出间隔, ms */
+#define V4L2_CID_GXMICRO_DUPS		(V4L2_CID_GXMICRO_BASE + 9)	/* 未输出的重复帧, 只读 */
+#define V4L2_CID_GXMICRO_META_TILES	(V4L2_CID_GXMICRO_BASE + 10)	/* 元数据记录变化的 tile */
+
+/*
+ * 重复帧: JPEG_BS_LENGTH 与码流哈希均与上一帧相同.
+ * FLAG, DROP 模式下重复帧的元数据记录标记 GXMICRO_META_FLAG_REPEAT, reader 收到的帧标记 GXMICRO_FRAME_FLAG_REPEAT;
+ * JPEG 只有帧内编码, 不使用 V4L2_BUF_FLAG_KEYFRAME / PFRAME.
+ */
+enum gxmicro_dup_mode {
+	GXMICRO_DUP_OFF = 0,
+	GXMICRO_DUP_FLAG = 1,	/* 输出所有帧 */
+	GXMICRO_DUP_DROP = 2,	/* 仅每 DUP_KEEPALIVE ms 输出一个重复帧 */
+};
+
+/* ****************************** Metadata ****************************** */
+
+/* V4L2_BUF_TYPE_META_CAPTURE: 每帧变化的 tile 与编码统计, 与 JPEG buffer 通过 sequence 对应 */
+#define V4L2_META_FMT_GXMICRO_TILES	v4l2_fourcc('G', 'X', 'T', 'M')
+
+#define GXMICRO_META_TILES_MAX		512
+#define GXMICRO_META_FLAG_FULL		(1 << 0)	/* 无上一帧可比较或未计算哈希, 所有 tile 视为变化 */
+#define GXMICRO_META_FLAG_OVERFLOW	(1 << 1)	/* 重新编码后仍 overflow, JPEG buffer 为 V4L2_BUF_FLAG_ERROR */
+#define GXMICRO_META_FLAG_REPEAT	(1 << 2)	/* 与上一帧相同 (V4L2_CID_GXMICRO_DUP_MODE), DROP 模式下可能未输出 */
+
+struct gxmicro_jpeg_meta {
+	__u32 sequence;		/* v4l2_buffer.sequence of the JPEG frame */
+	__u32 flags;		/* GXMICRO_META_FLAG_* */
+	__u16 tile_size;	/* 像素 */
+	__u16 tiles_x;
+	__u16 tiles_y;
+	__u16 reserved;
+	__u32 dirty[GXMICRO_META_TILES_MAX / 32];	/* tile (x, y) 为 bit (y * tiles_x + x), 低位在前 */
+
+	/* 编码统计 */
+	__u32 qp;		/* 最后一次编码的 JPEG_ENC_QP */
+	__u32 retries;		/* overflow 后重新编码次数 */
+	__u32 encode_us;	/* 最后一次编码 JPEG_ENC_START -> EOF */
+	__u32 bytesused;	/* JPEG_BS_LENGTH */
+};
+
+/* ****************************** Readers ****************************** */
+
+/*
+ * 多个 file handle 共享 capture 队列的码流: 每帧只编码一次, 按引用分发给各 reader.
+ * 每个 file handle 只能设置一次, 之后通过 read() 或 VIDIOC_GXMICRO_DQFRAME 取帧.
+ * reader 设置时队列中已有最新完成的一帧 (若存在), 可立即读取.
+ * 未启用后台快照 (snapshot_ms 0) 时, 实时采集的帧无法分发的模式下 S_READER 返回 -EOPNOTSUPP.
+ * VIDIOC_GXMICRO_G_SNAPSHOT 不需要设置 reader, 返回最新完成的一帧, 没有时返回 -ENODATA;
+ * 保留的帧已过期时等待下一帧, 超时返回 -ETIMEDOUT.
+ * DQFRAME, G_SNAPSHOT 的 length 小于该帧时返回 -ENOSPC, bytesused 仍为该帧大小.
+ * 这些 ioctl 不持有设备锁, 阻塞时不影响队列所有者的 QBUF / DQBUF.
+ */
+#define GXMICRO_READER_DEPTH_MAX	16
+
+enum gxmicro_reader_policy {
+	GXMICRO_READER_DROP_OLDEST = 0,	/* 队列满时丢弃最旧的帧 */
+	GXMICRO_READER_DROP_NEWEST = 1,	/* 队列满时丢弃新完成的帧 */
+};
+
+struct gxmicro_reader_cfg {
+	__u32 depth;		/* 1 ~ GXMICRO_READER_DEPTH_MAX */
+	__u32 policy;		/* enum gxmicro_reader_policy */
+	__u32 reserved[2];
+};
+
+#define GXMICRO_FRAME_FLAG_REPEAT	(1 << 0)	/* 与上一帧相同 (V4L2_CID_GXMICRO_DUP_MODE) */
+
+struct gxmicro_frame_info {
+	__u64 data;		/* 用户空间 buffer */
+	__u32 length;		/* data 大小 */
+	__u32 bytesused;	/* JPEG 大小 */
+	__u32 sequence;
+	__u32 flags;		/* GXMICRO_FRAME_FLAG_* */
+	__u64 timestamp;	/* CLOCK_MONOTONIC, ns */
+	__u32 drops;		/* 该 reader 队列满丢弃的帧 */
+	__u32 reserved[3];
+};
+
+#define VIDIOC_GXMICRO_S_READER		_IOW('V', BASE_VIDIOC_PRIVATE + 0, struct gxmicro_reader_cfg)
+#define VIDIOC_GXMICRO_DQFRAME		_IOWR('V', BASE_VIDIOC_PRIVATE + 1, struct gxmicro_frame_info)
+#define VIDIOC_GXMICRO_G_SNAPSHOT	_IOWR('V', BASE_VIDIOC_PRIVATE + 2, struct gxmicro_frame_info)
+
+#endif /* __GXMICRO_UAPI_H__ */
@@ -7,30 +7,916 @@
  * Author:
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
-#include <linux/of_irq.h>
+#include <linux/version.h>
+#include <linux/platform_device.h>
+#include <linux/highmem.h>
+#include <linux/bitfield.h>
+#include <linux/math64.h>
+#include <linux/dma-mapping.h>
+#include <linux/xxhash.h>
 #include <media/videobuf2-dma-contig.h>
+#include <media/v4l2-event.h>
 
 #include "gxmicro_jpeg.h"
 
+#define CREATE_TRACE_POINTS
+#include "gxmicro_trace.h"
+
+static bool pipeline = true;
+module_param(pipeline, bool, 0444);
+MODULE_PARM_DESC(pipeline, "Restart the encoder in hard IRQ, complete buffers in irq thread (default true)");
+
+static bool hardirq;
+module_param(hardirq, bool, 0444);
+MODULE_PARM_DESC(hardirq, "Complete buffers and restart the encoder in hard IRQ, no irq thread (default false)");
+
+static unsigned int overflow_retries = JPEG_RETRY_DEF;
+module_param(overflow_retries, uint, 0644);
+MODULE_PARM_DESC(overflow_retries, "Re-encode an overflowed frame with doubled QP up to N times (default 2)");
+
+static unsigned int snapshot_ms = JPEG_SNAPSHOT_DEF;
+module_param(snapshot_ms, uint, 0444);
+MODULE_PARM_DESC(snapshot_ms, "Background encode interval while not streaming, 0 to disable (default 1000)");
+
 struct gxmicro_buffer {
 	struct vb2_v4l2_buffer vbuf;
 	struct list_head list;
+	dma_addr_t addr;	/* JPEG_BS_BASE, staged in buf_queue */
+	uint32_t size;		/* JPEG_BS_LEN_MAX */
+	uint32_t fsize;		/* JPEG_BS_LENGTH */
+	uint32_t qp;		/* JPEG_ENC_QP */
+	enum v4l2_jpeg_chroma_subsampling subsampling;	/* JPEG_BS_FORMAT */
+	bool req_setup;		/* Request API: 控件已应用 */
+	uint32_t retries;	/* JPEG_BS_OVERFLOW 后重新编码次数 */
+	bool overflow;		/* JPEG_BS_OVERFLOW */
+	bool resized;		/* 编码期间源分辨率变化 */
+	bool published;		/* 已复制给 reader 与快照 */
 };
 #define vbuf_to_gxmicro_buffer(vbuf)	container_of(vbuf, struct gxmicro_buffer, vbuf)
 
+static uint32_t gxmicro_jpeg_raw_size(uint32_t width, uint32_t height,
+				      enum v4l2_jpeg_chroma_subsampling subsampling)
+{
+	switch (subsampling) {
+	case V4L2_JPEG_CHROMA_SUBSAMPLING_444:
+		return JPEG_SZ(height, JPEG_BPL(width, JPEG_24BPP));
+	case V4L2_JPEG_CHROMA_SUBSAMPLING_420:
+		return JPEG_SZ(height, JPEG_BPL(width, JPEG_12BPP));
+	default:
+		return 0;
+	}
+}
+
+/*
+ * 码流大小估算: 原始 YUV 大小按 QP 缩放, 默认 QP 时约为原始大小的 1 / 9.
+ * Reserved: 系数需根据硬件实测校准, 估算偏小时由 JPEG_BS_OVERFLOW 保证安全.
+ */
+uint32_t gxmicro_jpeg_bs_estimate(uint32_t width, uint32_t height,
+				   enum v4l2_jpeg_chroma_subsampling subsampling, uint32_t qp)
+{
+	uint32_t raw, size;
+
+	raw = gxmicro_jpeg_raw_size(width, height, subsampling);
+	if (!raw)
+		return 0;
+
+	size = JPEG_BS_HDR + div_u64((uint64_t)raw * JPEG_QP_DEF, JPEG_QP_DEF + qp * JPEG_BS_QP_SCALE);
+
+	return clamp_t(uint32_t, PAGE_ALIGN(size), PAGE_SIZE, JPEG_MAX_BS);
+}
+
+/*
+ * 码流上限: 与其他 V4L2 JPEG 编码器相同取原始 YUV 大小加文件头, 与 QP 无关, 不依赖估算系数.
+ * 8 bit 基线 JPEG 只有接近 JPEG_QP_MIN 且源图像接近噪声时才可能超过, 由 JPEG_BS_OVERFLOW 重新编码处理.
+ */
+static uint32_t gxmicro_jpeg_bs_max(uint32_t width, uint32_t height,
+				    enum v4l2_jpeg_chroma_subsampling subsampling)
+{
+	uint32_t raw;
+
+	raw = gxmicro_jpeg_raw_size(width, height, subsampling);
+	if (!raw)
+		return 0;
+
+	return min_t(uint32_t, PAGE_ALIGN(JPEG_BS_HDR + raw), JPEG_MAX_BS);
+}
+
+/* ****************************** Format ****************************** */
+
+/*
+ * gdev->fmt: G_FMT, DV timings, queue_setup, buf_prepare 与统计只读取缓存, 不访问寄存器.
+ * 打开设备与 REQBUFS 时从寄存器同步, STREAMON 期间由硬中断检测分辨率变化 (gxmicro_source_check()),
+ * 未 STREAMON 时由后台快照的硬中断检测; snapshot_ms 为 0 时由 G_FMT 与 QUERY_DV_TIMINGS 读取寄存器 (gxmicro_format_poll()).
+ * JPEG_ENC_FORMAT 在 gxmicro_jpeg_start() 已读取的 JPEG_CONF 中更新, QP 与 subsampling 在控件修改时更新.
+ * sizeimage 为 REQBUFS 分配的码流上限; CBR 时 QP 每帧变化, estimate 仍按 V4L2_CID_JPEG_COMPRESSION_QUALITY 估算.
+ */
+
+/* gdev->buf_lock spinlock must be held by caller, 由 width, height, enc 与控件计算其余字段 */
+static void gxmicro_format_calc(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_format *fmt = &gdev->fmt;
+
+	switch (fmt->enc) {
+	case JPEG_ENC_RBG565:
+	case JPEG_ENC_YUV422:
+		fmt->bpp = JPEG_16BPP;
+		break;
+	case JPEG_ENC_XRGB888:
+		fmt->bpp = JPEG_32BPP;
+		break;
+	default:
+		fmt->bpp = 0;
+		break;
+	}
+
+	fmt->bpl = JPEG_BPL(fmt->width, fmt->bpp);
+	fmt->subsampling = READ_ONCE(gdev->subsampling);
+	fmt->sizeimage = gxmicro_jpeg_bs_max(fmt->width, fmt->height, fmt->subsampling);
+	fmt->estimate = gxmicro_jpeg_bs_estimate(fmt->width, fmt->height, fmt->subsampling, gdev->quality);
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 返回 true: 分辨率变化, 已发送 V4L2_EVENT_SOURCE_CHANGE */
+static bool gxmicro_format_set(struct gxmicro_jpeg_dev *gdev, uint32_t width, uint32_t height, uint32_t enc)
+{
+	static const struct v4l2_event ev = {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+		.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
+	};
+	struct gxmicro_format *fmt = &gdev->fmt;
+	bool resized;
+
+	resized = width != fmt->width || height != fmt->height;
+	if (!resized && enc == fmt->enc)
+		return false;
+
+	if (resized)
+		dev_dbg(gdev->dev, "source change: %ux%u -> %ux%u\n", fmt->width, fmt->height, width, height);
+
+	fmt->width = width;
+	fmt->height = height;
+	fmt->enc = enc;
+	gxmicro_format_calc(gdev);
+
+	/* 后台快照在 video 节点注册前已开始 */
+	if (resized && video_is_registered(&gdev->vdev))
+		v4l2_event_queue(&gdev->vdev, &ev);
+
+	return resized;
+}
+
+/*
+ * gdev->buf_lock spinlock must be held by caller
+ *
+ * 实时采集的源图像寄存器. m2m job 执行期间 JPEG_FB_BASE, JPEG_WIDTH, JPEG_HEIGHT, JPEG_CONF 为 job 的值,
+ * 返回 job 前保存的值, 分辨率检测与 tile 映射不会把 m2m 的 OUTPUT buffer 当作源图像.
+ */
+static void gxmicro_source_read(struct gxmicro_jpeg_dev *gdev, uint32_t *width, uint32_t *height, uint32_t *enc)
+{
+	struct gxmicro_m2m *m2m = &gdev->m2m;
+
+	if (m2m->active) {
+		*width = m2m->width;
+		*height = m2m->height;
+		*enc = m2m->jconf & JPEG_ENC_FORMAT_MASK;
+		return;
+	}
+
+	*width = gxmicro_read(gdev, JPEG_WIDTH);
+	*height = gxmicro_read(gdev, JPEG_HEIGHT);
+	*enc = gxmicro_read(gdev, JPEG_CONF) & JPEG_ENC_FORMAT_MASK;
+}
+
+/* 可睡眠上下文调用, 见 gxmicro_source_read() */
+uint32_t gxmicro_source_base(struct gxmicro_jpeg_dev *gdev)
+{
+	unsigned long flags;
+	uint32_t base;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	base = gdev->m2m.active ? gdev->m2m.fb_base : gxmicro_read(gdev, JPEG_FB_BASE);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	return base;
+}
+
+/* gdev->buf_lock spinlock must be held by caller */
+static bool gxmicro_format_sync(struct gxmicro_jpeg_dev *gdev)
+{
+	uint32_t width, height, enc;
+
+	gxmicro_source_read(gdev, &width, &height, &enc);
+
+	return gxmicro_format_set(gdev, width, height, enc);
+}
+
+/* QP, subsampling 控件修改后调用 */
+void gxmicro_format_update(struct gxmicro_jpeg_dev *gdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	gxmicro_format_calc(gdev);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+/* 打开设备, REQBUFS 时调用; STREAMON 期间由硬中断检测, 变化时需要完成正在编码的帧 */
+void gxmicro_format_refresh(struct gxmicro_jpeg_dev *gdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	if (!vb2_is_streaming(&gdev->vbq))
+		gxmicro_format_sync(gdev);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+/*
+ * G_FMT, QUERY_DV_TIMINGS 时调用, 通常返回缓存: STREAMON 期间由硬中断, 未 STREAMON 时由后台快照更新.
+ * 只有两者都不运行 (未 STREAMON 且 snapshot_ms 为 0) 时读取寄存器, 否则无法发现分辨率变化.
+ */
+void gxmicro_format_poll(struct gxmicro_jpeg_dev *gdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	if (!vb2_is_streaming(&gdev->vbq) && !gdev->snap.vaddr)
+		gxmicro_format_sync(gdev);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+void gxmicro_format_get(struct gxmicro_jpeg_dev *gdev, struct gxmicro_format *fmt)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	*fmt = gdev->fmt;
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+static void gxmicro_format_init(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_format *fmt = &gdev->fmt;
+
+	/* probe 时没有中断与 file handle, 不需要 buf_lock */
+	fmt->width = gxmicro_read(gdev, JPEG_WIDTH);
+	fmt->height = gxmicro_read(gdev, JPEG_HEIGHT);
+	fmt->enc = gxmicro_read(gdev, JPEG_CONF) & JPEG_ENC_FORMAT_MASK;
+	gxmicro_format_calc(gdev);
+}
+
+static void gxmicro_snap_run(struct gxmicro_jpeg_dev *gdev);
+
+/* gdev->buf_lock spinlock must be held by caller, 编码器空闲时执行等待中的 m2m job 或快照 */
+static void gxmicro_engine_next(struct gxmicro_jpeg_dev *gdev)
+{
+	if (gdev->encoding || gdev->m2m.active || gdev->snap.active)
+		return;
+
+	if (gdev->m2m.pending)
+		gxmicro_m2m_run(gdev);
+	else if (gdev->snap.pending)
+		gxmicro_snap_run(gdev);
+}
+
 /* gdev->buf_lock spinlock must be held by caller */
 static void gxmicro_jpeg_start(struct gxmicro_jpeg_dev *gdev)
 {
 	struct gxmicro_buffer *gbuf;
-	dma_addr_t addr;
+	ktime_t now, interval;
+	uint32_t jconf;
 
 	gbuf = list_first_entry(&gdev->buffers, struct gxmicro_buffer, list);
 
-	addr = vb2_dma_contig_plane_dma_addr(&gbuf->vbuf.vb2_buf, 0);
+	/* 后台快照编码中: 本帧在快照完成后启动 */
+	if (gdev->snap.active) {
+		gdev->snap.deferred = true;
+		gdev->busy = true;
+		return;
+	}
+
+	/* m2m job 正在执行或等待中: 先执行 job, 本帧在 job 完成后启动 */
+	if (gdev->m2m.active || (gdev->m2m.pending && !gbuf->retries)) {
+		gdev->m2m.deferred = true;
+		gdev->busy = true;
+		if (!gdev->m2m.active)
+			gxmicro_m2m_run(gdev);
+		return;
+	}
+
+	/* 实时采集的帧无法分发给 reader 时的快照请求, 同样在本帧之前执行 */
+	if (gdev->snap.pending && !gbuf->retries) {
+		gdev->snap.deferred = true;
+		gdev->busy = true;
+		gxmicro_snap_run(gdev);
+		return;
+	}
+
+	/* 重新编码时使用 overflow 后增大的 QP, 且不占用新的帧间隔 */
+	if (!gbuf->retries) {
+		gbuf->qp = READ_ONCE(gdev->qp);
+		gbuf->subsampling = READ_ONCE(gdev->subsampling);
+
+		/* 以上一次的预定启动时刻为基准, 避免定时器延迟累积 */
+		now = ktime_get();
+		interval = READ_ONCE(gdev->interval);
+		if (ktime_sub(now, gdev->next_start) >= interval)
+			gdev->next_start = now;
+		gdev->next_start = ktime_add(gdev->next_start, interval);
+	}
 
-	gxmicro_write(gdev, JPEG_BS_BASE, addr);
+	gxmicro_write(gdev, JPEG_BS_BASE, gbuf->addr);
+	gxmicro_write(gdev, JPEG_BS_LEN_MAX, gbuf->size);
+	gxmicro_write(gdev, JPEG_ENC_QP, gbuf->qp);
+
+	/* 编码过程中不修改 JPEG_BS_FORMAT, 控件在下一帧启动时生效 */
+	jconf = gxmicro_read(gdev, JPEG_CONF);
+	gxmicro_format_set(gdev, gdev->fmt.width, gdev->fmt.height, jconf & JPEG_ENC_FORMAT_MASK);
+	jconf &= ~JPEG_BS_FORMAT_MASK;
+	if (gbuf->subsampling == V4L2_JPEG_CHROMA_SUBSAMPLING_420)
+		jconf |= FIELD_PREP(JPEG_BS_FORMAT_MASK, JEPG_BS_YUV420);
+	else
+		jconf |= FIELD_PREP(JPEG_BS_FORMAT_MASK, JEPG_BS_YUV444);
+	gxmicro_write(gdev, JPEG_CONF, jconf);
 
 	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_START);
+	gdev->enc_start = ktime_get_ns();
+	trace_gxmicro_jpeg_start(gbuf->vbuf.vb2_buf.index, gbuf->qp, gbuf->subsampling, gbuf->retries);
+
+	gdev->busy = true;
+	gdev->encoding = true;
+}
+
+/* ****************************** Source Change ****************************** */
+
+/*
+ * 主机切换显示模式时 JPEG_WIDTH / JPEG_HEIGHT 随之变化, 在每帧的硬中断中与上一次的值比较,
+ * 变化时发送 V4L2_EVENT_SOURCE_CHANGE. 用户收到事件后 STREAMOFF, 按新的 G_FMT 重新 REQBUFS.
+ */
+
+/* gdev->buf_lock spinlock must be held by caller, 硬中断中调用, 返回 true: 分辨率变化 */
+static bool gxmicro_source_check(struct gxmicro_jpeg_dev *gdev)
+{
+	uint32_t width, height, enc;
+
+	gxmicro_source_read(gdev, &width, &height, &enc);
+
+	return gxmicro_format_set(gdev, width, height, gdev->fmt.enc);
+}
+
+/*
+ * gdev->buf_lock spinlock must be held by caller
+ *
+ * 分辨率变化后, 队首 (刚完成编码的 buffer) 以外装不下新分辨率码流的 buffer 以 VB2_BUF_STATE_ERROR 返回,
+ * 按当前 QP 的估算大小判断, 不再以必然 overflow 的 buffer 启动编码, 避免逐个经过重新编码后仍以错误返回.
+ */
+static void gxmicro_buf_evict(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_buffer *gbuf, *tmp;
+
+	gbuf = list_first_entry_or_null(&gdev->buffers, struct gxmicro_buffer, list);
+	if (!gbuf)
+		return;
+
+	list_for_each_entry_safe_continue(gbuf, tmp, &gdev->buffers, list) {
+		if (gbuf->size >= gdev->fmt.estimate)
+			continue;
+
+		list_del(&gbuf->list);
+		vb2_buffer_done(&gbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+		gdev->debug.errors++;
+	}
+}
+
+/* ****************************** Snapshot ****************************** */
+
+/*
+ * capture 队列未 STREAMON 时, 每 snapshot_ms 在编码器空闲时编码一帧到驱动自己的 buffer,
+ * 由 gxmicro_fanout_publish() 保存为最新帧, 新打开的 reader 不需要等待 STREAMON 与第一次编码.
+ * STREAMON 期间实时采集的帧不经过 irq thread 的 MMAP 路径时 (hardirq, Low latency, DMABUF / USERPTR)
+ * 无法复制, 有 reader 或 G_SNAPSHOT 等待时同样每 snapshot_ms 编码一帧快照.
+ * 与 m2m 相同, 编码器忙时快照等待当前编码完成 (pending), 快照期间实时采集的帧推迟到快照完成后启动.
+ */
+
+/* gdev->buf_lock spinlock must be held by caller */
+static bool gxmicro_snap_needed(struct gxmicro_jpeg_dev *gdev)
+{
+	if (!vb2_is_streaming(&gdev->vbq))
+		return true;
+
+	return !gxmicro_vb2_publishes(gdev) && gxmicro_fanout_wanted(gdev);
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 编码器空闲 */
+static void gxmicro_snap_run(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_snap *snap = &gdev->snap;
+	uint32_t jconf;
+
+	/* 没有打开的 file handle 时中断未使能 */
+	snap->jconf = gxmicro_read(gdev, JPEG_CONF);
+	jconf = (snap->jconf & ~JPEG_BS_FORMAT_MASK) | JPEG_INTR_ENABLE;
+	if (READ_ONCE(gdev->subsampling) == V4L2_JPEG_CHROMA_SUBSAMPLING_420)
+		jconf |= FIELD_PREP(JPEG_BS_FORMAT_MASK, JEPG_BS_YUV420);
+	else
+		jconf |= FIELD_PREP(JPEG_BS_FORMAT_MASK, JEPG_BS_YUV444);
+
+	gxmicro_write(gdev, JPEG_CONF, jconf);
+	gxmicro_write(gdev, JPEG_BS_BASE, snap->dma);
+	gxmicro_write(gdev, JPEG_BS_LEN_MAX, snap->size);
+	gxmicro_write(gdev, JPEG_ENC_QP, READ_ONCE(gdev->qp));
+
+	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_START);
+
+	snap->pending = false;
+	snap->active = true;
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 恢复 JPEG_CONF 与推迟的实时采集, m2m job */
+static void gxmicro_snap_end(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_snap *snap = &gdev->snap;
+
+	gxmicro_write(gdev, JPEG_CONF, snap->jconf);
+	snap->active = false;
+
+	if (snap->deferred) {
+		snap->deferred = false;
+		if (list_empty(&gdev->buffers))
+			gdev->busy = false;
+		else
+			gxmicro_jpeg_start(gdev);
+	}
+
+	gxmicro_engine_next(gdev);
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 硬中断中调用 */
+static void gxmicro_snap_irq(struct gxmicro_jpeg_dev *gdev, uint32_t status)
+{
+	struct gxmicro_snap *snap = &gdev->snap;
+
+	/* 未 STREAMON 时也能通知订阅者, 快照本身按完成时的分辨率保存; STREAMON 时由实时采集的 EOF 检测 */
+	if (!vb2_is_streaming(&gdev->vbq))
+		gxmicro_source_check(gdev);
+
+	snap->fsize = gxmicro_read(gdev, JPEG_BS_LENGTH);
+	/* 与实时采集相同, 长度超过 buffer 时按 overflow 丢弃, 不复制 buffer 以外的内存 */
+	if (snap->fsize > snap->size) {
+		snap->fsize = 0;
+		status |= JPEG_BS_OVERFLOW;
+	}
+	snap->status = status;
+	snap->timestamp = ktime_get_ns();
+
+	gxmicro_snap_end(gdev);
+
+	complete(&snap->done);
+}
+
+static void gxmicro_snap_work(struct work_struct *work)
+{
+	struct gxmicro_snap *snap = container_of(to_delayed_work(work), struct gxmicro_snap, work);
+	struct gxmicro_jpeg_dev *gdev = container_of(snap, struct gxmicro_jpeg_dev, snap);
+	unsigned long flags;
+	bool started = false;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	/* STREAMON 时最新帧通常由 irq thread 保存 */
+	if (gxmicro_snap_needed(gdev)) {
+		reinit_completion(&snap->done);
+		if (gdev->encoding || gdev->m2m.active || gdev->m2m.pending)
+			snap->pending = true;	/* 当前编码或 m2m job 完成后执行 */
+		else
+			gxmicro_snap_run(gdev);
+		started = true;
+	}
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	if (!started)
+		goto snap_work;
+
+	if (!wait_for_completion_timeout(&snap->done, msecs_to_jiffies(JPEG_SNAPSHOT_TIMEOUT))) {
+		spin_lock_irqsave(&gdev->buf_lock, flags);
+		started = snap->active || snap->pending;
+		if (snap->active) {
+			gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_STOP);
+			gxmicro_snap_end(gdev);
+		}
+		snap->pending = false;
+		spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+		/* 超时期间中断可能已经到达 */
+		if (started) {
+			dev_dbg(gdev->dev, "snapshot timeout\n");
+			goto snap_work;
+		}
+	}
+
+	if (snap->status & JPEG_BS_OVERFLOW) {
+		dev_dbg(gdev->dev, "snapshot overflow: JPEG_BS_LEN_MAX %u\n", snap->size);
+		goto snap_work;
+	}
+
+	gxmicro_fanout_publish(gdev, snap->vaddr, snap->fsize, READ_ONCE(gdev->sequence), snap->timestamp, 0);
+
+snap_work:
+	schedule_delayed_work(&snap->work, msecs_to_jiffies(snapshot_ms));
+}
+
+/* G_SNAPSHOT 等待新帧时立即执行快照 work, 返回 false: 未启用后台快照 */
+bool gxmicro_snap_request(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_snap *snap = &gdev->snap;
+
+	if (!snap->vaddr)
+		return false;
+
+	mod_delayed_work(system_wq, &snap->work, 0);
+
+	return true;
+}
+
+static void gxmicro_snap_init(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_snap *snap = &gdev->snap;
+
+	INIT_DELAYED_WORK(&snap->work, gxmicro_snap_work);
+	init_completion(&snap->done);
+
+	if (!snapshot_ms)
+		return;
+
+	/* 最大分辨率, 默认 QP 的估算大小, overflow 时本次快照丢弃 */
+	snap->size = gxmicro_jpeg_bs_estimate(JPEG_MAX_WIDTH, JPEG_MAX_HEIGHT,
+					      V4L2_JPEG_CHROMA_SUBSAMPLING_444, JPEG_QP_DEF);
+	snap->vaddr = dma_alloc_coherent(gdev->dev, snap->size, &snap->dma, GFP_KERNEL);
+	if (!snap->vaddr) {
+		dev_warn(gdev->dev, "Failed to alloc snapshot buffer, snapshot disabled\n");
+		return;
+	}
+
+	schedule_delayed_work(&snap->work, 0);
+}
+
+static void gxmicro_snap_fini(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_snap *snap = &gdev->snap;
+
+	if (!snap->vaddr)
+		return;
+
+	/* work 返回时快照编码已完成或已停止 */
+	cancel_delayed_work_sync(&snap->work);
+	dma_free_coherent(gdev->dev, snap->size, snap->vaddr, snap->dma);
+	snap->vaddr = NULL;
+}
+
+/* 跳过未变化的画面, 或元数据节点需要变化的 tile 时计算哈希; 只需要编码统计时不计算 */
+static bool gxmicro_tile_wanted(struct gxmicro_jpeg_dev *gdev)
+{
+	return READ_ONCE(gdev->tile.enable) || (READ_ONCE(gdev->meta.streaming) && READ_ONCE(gdev->meta.tiles));
+}
+
+/* gdev->buf_lock spinlock must be held by caller */
+static void gxmicro_jpeg_trigger(struct gxmicro_jpeg_dev *gdev)
+{
+	struct gxmicro_buffer *gbuf;
+
+	gbuf = list_first_entry(&gdev->buffers, struct gxmicro_buffer, list);
+
+	/*
+	 * 以下情况在 start_work 中处理后再启动:
+	 * 	Request API: 应用该 buffer 所在 request 的控件
+	 * 	跳过未变化的画面, 或输出变化的 tile: 比较源图像
+	 */
+	if ((gbuf->vbuf.vb2_buf.req_obj.req && !gbuf->req_setup) || gxmicro_tile_wanted(gdev)) {
+		gdev->busy = true;
+		queue_work(system_highpri_wq, &gdev->start_work);
+		return;
+	}
+
+	/* 此帧未计算哈希, 下次比较时不能作为上一帧, 元数据记录视为全部变化 */
+	WRITE_ONCE(gdev->tile.valid, 0);
+	gxmicro_meta_stage(gdev, false);
+	gxmicro_jpeg_start(gdev);
+}
+
+/* gdev->buf_lock spinlock must be held by caller */
+static void gxmicro_jpeg_kick(struct gxmicro_jpeg_dev *gdev)
+{
+	/* 按 timeperframe 限制编码启动间隔, 未到时间由 pace 定时器启动 */
+	if (ktime_before(ktime_get(), gdev->next_start)) {
+		gdev->busy = true;
+		gdev->pacing = true;
+		hrtimer_start(&gdev->pace, gdev->next_start, HRTIMER_MODE_ABS);
+		return;
+	}
+
+	gxmicro_jpeg_trigger(gdev);
+}
+
+static void gxmicro_start_work(struct work_struct *work)
+{
+	struct gxmicro_jpeg_dev *gdev = container_of(work, struct gxmicro_jpeg_dev, start_work);
+	struct gxmicro_buffer *gbuf;
+	struct media_request *req = NULL;
+	unsigned long flags;
+	uint64_t hash_ns = 0;
+	bool tiles;
+	int changed = 1;
+
+	/* 编码器空闲, 队首 buffer 只会被 stop_streaming 移除, stop_streaming 等待本 work 结束 */
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+	gbuf = list_first_entry_or_null(&gdev->buffers, struct gxmicro_buffer, list);
+	if (gdev->busy && !gdev->pacing && gbuf && !gbuf->req_setup)
+		req = gbuf->vbuf.vb2_buf.req_obj.req;
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	/* Request API: 该 buffer 的 QP, subsampling 在其编码启动前生效 */
+	if (req) {
+		v4l2_ctrl_request_setup(req, &gdev->hdl);
+		v4l2_ctrl_request_complete(req, &gdev->hdl);
+		gbuf->req_setup = true;
+	}
+
+	tiles = gxmicro_tile_wanted(gdev);
+	if (tiles) {
+		hash_ns = ktime_get_ns();
+		changed = gxmicro_tile_update(gdev);
+		hash_ns = ktime_get_ns() - hash_ns;
+		if (changed < 0)
+			dev_warn_ratelimited(gdev->dev, "Failed to access JPEG_FB_BASE: %d\n", changed);
+	} else {
+		gdev->tile.valid = 0;
+	}
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	if (tiles && changed >= 0)
+		gxmicro_hist_add(&gdev->debug.hash, hash_ns);
+
+	/* 哈希基准已前移, 本帧未启动编码时变化的 tile 也要累加 */
+	gxmicro_meta_stage(gdev, tiles && changed >= 0);
+
+	/* stop_streaming */
+	if (!gdev->busy || gdev->pacing)
+		goto start_work;
+
+	if (list_empty(&gdev->buffers)) {
+		gdev->busy = false;
+		goto start_work;
+	}
+
+	if (changed || !READ_ONCE(gdev->tile.enable)) {
+		gxmicro_jpeg_start(gdev);
+		goto start_work;
+	}
+
+	/* 画面未变化, 一个帧间隔后再比较 */
+	gdev->stats.skips++;
+	gdev->next_start = ktime_add(ktime_get(), READ_ONCE(gdev->interval));
+	gdev->pacing = true;
+	hrtimer_start(&gdev->pace, gdev->next_start, HRTIMER_MODE_ABS);
+
+start_work:
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+static enum hrtimer_restart gxmicro_pace_timer(struct hrtimer *timer)
+{
+	struct gxmicro_jpeg_dev *gdev = container_of(timer, struct gxmicro_jpeg_dev, pace);
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	if (gdev->pacing) {
+		gdev->pacing = false;
+		if (list_empty(&gdev->buffers))
+			gdev->busy = false;
+		else
+			gxmicro_jpeg_trigger(gdev);
+	}
+
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/* gdev->buf_lock spinlock must be held by caller */
+static void gxmicro_buf_done(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf)
+{
+	/* 溢出的码流被截断, 分辨率变化时的帧可能混合新旧画面, 都不能作为正常帧交给用户 */
+	bool error = gbuf->overflow || gbuf->resized;
+
+	vb2_set_plane_payload(&gbuf->vbuf.vb2_buf, 0, error ? 0 : gbuf->fsize);
+	gbuf->vbuf.field = V4L2_FIELD_NONE;
+	vb2_buffer_done(&gbuf->vbuf.vb2_buf, error ? VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE);
+	gdev->undequeued++;
+
+	/* 未复制的帧 (没有 reader, 或硬中断中完成), 快照已不是最新画面 */
+	if (!gbuf->published)
+		WRITE_ONCE(gdev->fanout.stale, true);
+
+	gxmicro_hist_add(&gdev->debug.done, ktime_get_ns() - gbuf->vbuf.vb2_buf.timestamp);
+	if (error) {
+		gdev->debug.errors++;
+	} else {
+		gdev->debug.frames++;
+		gdev->debug.bytes += gbuf->fsize;
+	}
+	trace_gxmicro_jpeg_done(gbuf->vbuf.vb2_buf.index, gbuf->vbuf.sequence, gbuf->fsize, gbuf->overflow);
+}
+
+/*
+ * gdev->buf_lock spinlock must be held by caller
+ *
+ * JPEG_BS_LENGTH 不可信: 超过 plane 大小时码流已被 JPEG_BS_LEN_MAX 截断, 按 overflow 以 VB2_BUF_STATE_ERROR 返回,
+ * 长度限制在 plane 内, 重复帧检测与 reader 复制不会读取 plane 以外的内存.
+ */
+static void gxmicro_buf_length(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf, uint32_t fsize)
+{
+	if (fsize > gbuf->size) {
+		dev_warn_ratelimited(gdev->dev, "JPEG_BS_LENGTH %u exceeds buffer size %u\n", fsize, gbuf->size);
+		gbuf->overflow = true;
+		fsize = gbuf->size;
+	}
+
+	gbuf->fsize = fsize;
+}
+
+/* gdev->buf_lock spinlock must be held by caller */
+static void gxmicro_buf_recycle(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf)
+{
+	gbuf->retries = 0;
+	gbuf->overflow = false;
+	gbuf->resized = false;
+	gbuf->published = false;
+	list_add_tail(&gbuf->list, &gdev->buffers);
+
+	if (!gdev->busy)
+		gxmicro_jpeg_kick(gdev);
+}
+
+enum gxmicro_frame_kind {
+	GXMICRO_FRAME_NEW,
+	GXMICRO_FRAME_REPEAT,		/* 与上一帧相同, 仍然输出 */
+	GXMICRO_FRAME_WITHHOLD,		/* 与上一帧相同, 回收 buffer */
+};
+
+/*
+ * irq thread 中 CPU 读取码流前调用, 仅 MMAP buffer 有内核映射, 其他内存类型返回 NULL.
+ * V4L2_MEMORY_FLAG_NON_COHERENT: vb2 在 vb2_buffer_done() 中才 invalidate, 读取前先同步已写入的部分.
+ */
+static void *gxmicro_buf_vaddr(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf)
+{
+	struct vb2_buffer *vb = &gbuf->vbuf.vb2_buf;
+	void *vaddr;
+
+	if (gbuf->overflow || gbuf->resized || vb->memory != VB2_MEMORY_MMAP)
+		return NULL;
+
+	vaddr = vb2_plane_vaddr(vb, 0);
+	if (!vaddr)
+		return NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)	/* 5.15: 只有一致性内存 */
+	if (vb->vb2_queue->non_coherent_mem) {
+		dma_sync_single_for_cpu(gdev->dev, gbuf->addr, gbuf->fsize, DMA_FROM_DEVICE);
+		invalidate_kernel_vmap_range(vaddr, gbuf->fsize);
+	}
+#endif
+
+	return vaddr;
+}
+
+/* 重复帧检测: 比较 JPEG_BS_LENGTH 与码流 xxh64, 只在 irq thread 中调用, 不持有 buf_lock */
+static enum gxmicro_frame_kind gxmicro_buf_fingerprint(struct gxmicro_jpeg_dev *gdev,
+						       struct gxmicro_buffer *gbuf, const void *vaddr)
+{
+	struct gxmicro_dup *dup = &gdev->dup;
+	uint32_t mode = READ_ONCE(dup->mode);
+	bool same;
+	uint64_t hash;
+	ktime_t now, keepalive;
+
+	if (mode == GXMICRO_DUP_OFF || !vaddr)
+		return GXMICRO_FRAME_NEW;
+
+	hash = xxh64(vaddr, gbuf->fsize, 0);
+	same = dup->valid && dup->len == gbuf->fsize && dup->hash == hash;
+
+	dup->valid = true;
+	dup->len = gbuf->fsize;
+	dup->hash = hash;
+
+	now = ktime_get();
+	if (!same) {
+		dup->last = now;
+		return GXMICRO_FRAME_NEW;
+	}
+
+	/* 画面静止时每 keepalive 输出一帧, 用户可据此判断设备仍在工作; 0: 不输出 */
+	keepalive = READ_ONCE(dup->keepalive);
+	if (mode == GXMICRO_DUP_DROP && (!keepalive || ktime_before(now, ktime_add(dup->last, keepalive))))
+		return GXMICRO_FRAME_WITHHOLD;
+
+	dup->last = now;
+	return GXMICRO_FRAME_REPEAT;
+}
+
+/* irq thread 中调用, 不持有 buf_lock: 重复帧检测后复制给各 reader, 没有 reader 与快照请求时不复制 */
+static enum gxmicro_frame_kind gxmicro_buf_inspect(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf)
+{
+	struct vb2_buffer *vb = &gbuf->vbuf.vb2_buf;
+	enum gxmicro_frame_kind frame;
+	void *vaddr;
+
+	vaddr = gxmicro_buf_vaddr(gdev, gbuf);
+	frame = gxmicro_buf_fingerprint(gdev, gbuf, vaddr);
+	if (frame != GXMICRO_FRAME_WITHHOLD && vaddr && gxmicro_fanout_wanted(gdev)) {
+		gxmicro_fanout_publish(gdev, vaddr, gbuf->fsize, gbuf->vbuf.sequence, vb->timestamp,
+				       frame == GXMICRO_FRAME_REPEAT ? GXMICRO_FRAME_FLAG_REPEAT : 0);
+		gbuf->published = true;
+	}
+
+	return frame;
+}
+
+/* gdev->buf_lock spinlock must be held by caller, 该帧的元数据记录随之输出 */
+static void gxmicro_buf_emit(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf,
+			     enum gxmicro_frame_kind frame)
+{
+	gxmicro_meta_release(gdev, gbuf->vbuf.sequence, frame != GXMICRO_FRAME_NEW);
+
+	if (frame == GXMICRO_FRAME_WITHHOLD) {
+		gdev->stats.dups++;
+		gdev->debug.drops++;
+		gxmicro_buf_recycle(gdev, gbuf);
+		return;
+	}
+
+	gxmicro_buf_done(gdev, gbuf);
+}
+
+/*
+ * gdev->buf_lock spinlock must be held by caller
+ *
+ * Low latency: 用户还未取走上一帧时, 保留最新完成的帧, 在 buf_finish (DQBUF) 时交给用户;
+ * 之前保留的帧被丢弃 (sequence 不连续), buffer 回收继续编码.
+ */
+static void gxmicro_buf_latest(struct gxmicro_jpeg_dev *gdev, struct gxmicro_buffer *gbuf)
+{
+	if (!gdev->undequeued) {
+		gxmicro_buf_done(gdev, gbuf);
+		return;
+	}
+
+	if (gdev->ready) {
+		gdev->stats.drops++;
+		gdev->debug.drops++;
+		gxmicro_buf_recycle(gdev, gdev->ready);
+	}
+
+	gdev->ready = gbuf;
+}
+
+/* STREAMON 且完成的帧经过 gxmicro_buf_inspect(): irq thread 完成的 MMAP buffer */
+bool gxmicro_vb2_publishes(struct gxmicro_jpeg_dev *gdev)
+{
+	return vb2_is_streaming(&gdev->vbq) && !hardirq && !READ_ONCE(gdev->low_latency) &&
+	       READ_ONCE(gdev->vbq.memory) == VB2_MEMORY_MMAP;
+}
+
+/*
+ * reader 能否收到帧: 后台快照可以代替任何模式; 否则只有 irq thread 的 MMAP 路径分发,
+ * hardirq 参数不会经过该路径, STREAMON 中的 Low latency, DMABUF / USERPTR 队列在 STREAMOFF 前不会.
+ */
+bool gxmicro_vb2_can_publish(struct gxmicro_jpeg_dev *gdev)
+{
+	if (gdev->snap.vaddr)
+		return true;
+
+	if (hardirq)
+		return false;
+
+	return !vb2_is_streaming(&gdev->vbq) || gxmicro_vb2_publishes(gdev);
+}
+
+void gxmicro_vb2_set_low_latency(struct gxmicro_jpeg_dev *gdev, bool enable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	gdev->low_latency = enable;
+
+	/* 关闭时立即交出保留的帧 */
+	if (!enable && gdev->ready) {
+		gxmicro_buf_done(gdev, gdev->ready);
+		gdev->ready = NULL;
+	}
+
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
 }
 
 /* ****************************** Videobuf2 Queue OPS ****************************** */
@@ -39,29 +925,23 @@ static int gxmicro_queue_setup(struct vb2_queue *vbq, unsigned int *nbuffers,
 				unsigned int *nplanes, unsigned int sizes[], struct device *alloc_devs[])
 {
 	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vbq);
-	uint32_t width, height;
-	uint8_t bpp;
-	uint32_t bpl, sizeimage;
-
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
-
-	switch (gdev->subsampling) {
-	case V4L2_JPEG_CHROMA_SUBSAMPLING_444:
-		bpp = JPEG_24BPP;
-		break;
-	case V4L2_JPEG_CHROMA_SUBSAMPLING_420:
-		bpp = JPEG_12BPP;
-		break;
-	default:
+	struct gxmicro_format fmt;
+	uint32_t sizeimage;
+
+	/* REQBUFS 按当前寄存器分配, STREAMON 期间的 CREATE_BUFS 使用缓存 */
+	gxmicro_format_refresh(gdev);
+	gxmicro_format_get(gdev, &fmt);
+	sizeimage = fmt.sizeimage;
+	if (!sizeimage)
 		return -EINVAL;
-	}
 
-	bpl = JPEG_BPL(width, bpp);
-	sizeimage = JPEG_SZ(height, bpl);
+	/* 编码器停在最后一个 buffer 上, 至少 JPEG_BUFFERS 个 buffer 才能持续输出 */
+	if (vbq->num_buffers + *nbuffers < JPEG_BUFFERS)
+		*nbuffers = JPEG_BUFFERS - vbq->num_buffers;
 
+	/* CREATE_BUFS 可指定小于 sizeimage 的 buffer 节省内存, 至少为当前 QP 的估算大小 */
 	if (*nplanes)
-		return sizes[0] < sizeimage ? -EINVAL : 0;
+		return sizes[0] < fmt.estimate ? -EINVAL : 0;
 
 	*nplanes = 1;
 	sizes[0] = sizeimage;
@@ -72,26 +952,14 @@ static int gxmicro_queue_setup(struct vb2_queue *vbq, unsigned int *nbuffers,
 static int gxmicro_buf_prepare(struct vb2_buffer *vb)
 {
 	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vb->vb2_queue);
-	uint32_t width, height;
-	uint8_t bpp;
-	uint32_t bpl, sizeimage;
-
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
+	struct gxmicro_format fmt;
+	uint32_t sizeimage;
 
-	switch (gdev->subsampling) {
-	case V4L2_JPEG_CHROMA_SUBSAMPLING_444:
-		bpp = JPEG_24BPP;
-		break;
-	case V4L2_JPEG_CHROMA_SUBSAMPLING_420:
-		bpp = JPEG_12BPP;
-		break;
-	default:
+	/* CREATE_BUFS, USERPTR 与 DMABUF 的 buffer 可小于 sizeimage, 要求不小于当前 QP 的估算值, 溢出由 JPEG_BS_OVERFLOW 处理 */
+	gxmicro_format_get(gdev, &fmt);
+	sizeimage = fmt.estimate;
+	if (!sizeimage)
 		return -EINVAL;
-	}
-
-	bpl = JPEG_BPL(width, bpp);
-	sizeimage = JPEG_SZ(height, bpl);
 
 	if (vb2_plane_size(vb, 0) < sizeimage)
 		return -EINVAL;
@@ -108,9 +976,17 @@ static int gxmicro_start_streaming(struct vb2_queue *vbq, unsigned int count)
 	/* Reserved: start failed: vb2_buffer_done(, VB2_BUF_STATE_QUEUED) INIT_LIST_HEAD() */
 
 	gdev->sequence = 0;
+	gdev->undequeued = 0;
+	gdev->dup.valid = false;
+	memset(&gdev->stats, 0, sizeof(gdev->stats));
 
+	/* Request API 要求 min_buffers_needed 为 0, 可能还没有 buffer, 由 gxmicro_buf_queue() 启动 */
 	spin_lock_irqsave(&gdev->buf_lock, flags);
-	gxmicro_jpeg_start(gdev);
+	gdev->next_start = 0;
+	/* 以 STREAMON 时的分辨率为基准, 之后的变化由 gxmicro_source_check() 通知 */
+	gxmicro_format_sync(gdev);
+	if (!list_empty(&gdev->buffers))
+		gxmicro_jpeg_trigger(gdev);
 	spin_unlock_irqrestore(&gdev->buf_lock, flags);
 
 	return 0;
@@ -124,13 +1000,35 @@ static void gxmicro_stop_streaming(struct vb2_queue *vbq)
 
 	/* Reserved: JPEG Reset ? */
 
-	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_STOP);
-
 	spin_lock_irqsave(&gdev->buf_lock, flags);
+	trace_gxmicro_jpeg_stop(gdev->encoding, gdev->sequence);
+	/* 编码器可能正在执行 m2m job */
+	if (gdev->encoding)
+		gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_STOP);
+	gdev->encoding = false;
+	gdev->m2m.deferred = false;
+	gdev->snap.deferred = false;
+	gxmicro_engine_next(gdev);
+	gdev->busy = false;
+	gdev->pacing = false;
+	if (gdev->ready) {
+		vb2_buffer_done(&gdev->ready->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+		gdev->ready = NULL;
+	}
+	list_for_each_entry(gbuf, &gdev->done, list)
+		vb2_buffer_done(&gbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+	INIT_LIST_HEAD(&gdev->done);
 	list_for_each_entry(gbuf, &gdev->buffers, list)
 		vb2_buffer_done(&gbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
 	INIT_LIST_HEAD(&gdev->buffers);
+	gxmicro_meta_flush(gdev);
 	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
+	/* irq thread 可能在不持有 buf_lock 时访问 buffer 内容 */
+	synchronize_irq(gdev->irq);
+	hrtimer_cancel(&gdev->pace);
+	cancel_work_sync(&gdev->start_work);
+	gxmicro_tile_unmap(gdev);
 }
 
 static void gxmicro_buf_queue(struct vb2_buffer *vb)
@@ -140,19 +1038,66 @@ static void gxmicro_buf_queue(struct vb2_buffer *vb)
 	struct gxmicro_buffer *gbuf = vbuf_to_gxmicro_buffer(vbuf);
 	unsigned long flags;
 
+	gbuf->addr = vb2_dma_contig_plane_dma_addr(vb, 0);
+	gbuf->size = vb2_plane_size(vb, 0);
+	gbuf->retries = 0;
+	gbuf->overflow = false;
+	gbuf->resized = false;
+	gbuf->published = false;
+	gbuf->req_setup = false;
+
 	spin_lock_irqsave(&gdev->buf_lock, flags);
 	list_add_tail(&gbuf->list, &gdev->buffers);
+	/* 编码器停在最后一个 buffer 上, 有新 buffer 时重新启动 */
+	if (vb2_is_streaming(vb->vb2_queue) && !gdev->busy)
+		gxmicro_jpeg_kick(gdev);
 	spin_unlock_irqrestore(&gdev->buf_lock, flags);
 }
 
+static void gxmicro_buf_finish(struct vb2_buffer *vb)
+{
+	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vb->vb2_queue);
+	struct gxmicro_buffer *gbuf;
+	unsigned long flags;
+
+	if (vb->state == VB2_BUF_STATE_DONE)
+		trace_gxmicro_jpeg_dqbuf(vb->index, to_vb2_v4l2_buffer(vb)->sequence, vb->timestamp);
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	if (gdev->undequeued)
+		gdev->undequeued--;
+
+	/* Low latency: 用户取走上一帧后, 立即交出最新的帧 */
+	gbuf = gdev->ready;
+	if (!gdev->undequeued && gbuf) {
+		gdev->ready = NULL;
+		gxmicro_buf_done(gdev, gbuf);
+	}
+
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+}
+
+/* 未启动编码便被取消的 buffer, 完成其 request 中的控件 */
+static void gxmicro_buf_request_complete(struct vb2_buffer *vb)
+{
+	struct gxmicro_jpeg_dev *gdev = vb2_get_drv_priv(vb->vb2_queue);
+	struct gxmicro_buffer *gbuf = vbuf_to_gxmicro_buffer(to_vb2_v4l2_buffer(vb));
+
+	if (!gbuf->req_setup)
+		v4l2_ctrl_request_complete(vb->req_obj.req, &gdev->hdl);
+}
+
 static const struct vb2_ops gxmicro_vb2_ops = {
 	.queue_setup = gxmicro_queue_setup,
 	.wait_prepare = vb2_ops_wait_prepare,
 	.wait_finish = vb2_ops_wait_finish,
 	.buf_prepare = gxmicro_buf_prepare,
+	.buf_finish = gxmicro_buf_finish,
 	.start_streaming = gxmicro_start_streaming,
 	.stop_streaming = gxmicro_stop_streaming,	/* Reserved: JPEG stop, intr clk ... */
 	.buf_queue = gxmicro_buf_queue,
+	.buf_request_complete = gxmicro_buf_request_complete,
 };
 
 static int gxmicro_vbq_init(struct gxmicro_jpeg_dev *gdev)
@@ -161,7 +1106,7 @@ static int gxmicro_vbq_init(struct gxmicro_jpeg_dev *gdev)
 	int ret;
 
 	vbq->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	vbq->io_modes = VB2_MMAP | VB2_READ;
+	vbq->io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_READ;	/* USERPTR 需物理连续 */
 	vbq->dev = gdev->dev;
 	vbq->lock = &gdev->vlock;
 	vbq->ops = &gxmicro_vb2_ops;
@@ -169,7 +1114,8 @@ static int gxmicro_vbq_init(struct gxmicro_jpeg_dev *gdev)
 	vbq->drv_priv = gdev;
 	vbq->buf_struct_size = sizeof(struct gxmicro_buffer);	/* 私有buffer, vb2_v4l2_buffer 必须在第一个 */
 	vbq->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
-	vbq->min_buffers_needed = JPEG_BUFFERS;
+	vbq->supports_requests = true;	/* 每个 buffer 的 QP, subsampling */
+	gxmicro_vb2_cache_hints(gdev, vbq);	/* 用户以 cached 映射读取码流 */
 
 	ret = vb2_queue_init(vbq);
 	if (ret) {
@@ -196,21 +1142,119 @@ static void gxmicro_vbq_fini(struct gxmicro_jpeg_dev *gdev)
 static irqreturn_t gxmicro_irq_handler(int irq, void *arg)
 {
 	struct gxmicro_jpeg_dev *gdev = arg;
+	struct gxmicro_m2m_ctx *ctx;
 	struct gxmicro_buffer *gbuf;
-	irqreturn_t ret = IRQ_NONE;
-	uint32_t dummy;
+	irqreturn_t ret;
+	uint32_t status;
+	uint64_t encode_ns;
+	bool resized;
+
+	status = gxmicro_read(gdev, JPEG_INTR);
+	if (!(status & JPEG_INTR_MASK))
+		return IRQ_NONE;	/* 共享或伪中断, 不能作为 EOF 完成 buffer */
 
-	/* Reserved: overflow */
-	dummy = gxmicro_read(gdev, JPEG_INTR);
 	gxmicro_write(gdev, JPEG_INTR, JPEG_INTR_MASK);
-	dev_dbg(gdev->dev, "irq: 0x%04x\n", dummy);
+	trace_gxmicro_jpeg_irq(status);
+
+	ret = IRQ_HANDLED;
 
 	spin_lock(&gdev->buf_lock);
 
+	/* m2m job 完成, 恢复实时采集 */
+	if (gdev->m2m.active) {
+		ctx = gxmicro_m2m_irq(gdev);
+		if (gdev->m2m.deferred) {
+			gdev->m2m.deferred = false;
+			if (list_empty(&gdev->buffers))
+				gdev->busy = false;
+			else
+				gxmicro_jpeg_start(gdev);
+		}
+		gxmicro_engine_next(gdev);
+		spin_unlock(&gdev->buf_lock);
+
+		gxmicro_m2m_done(gdev, ctx, status);
+		return ret;
+	}
+
+	/* 后台快照完成 */
+	if (gdev->snap.active) {
+		gxmicro_snap_irq(gdev, status);
+		spin_unlock(&gdev->buf_lock);
+		return ret;
+	}
+
+	gdev->encoding = false;
+	encode_ns = ktime_get_ns() - gdev->enc_start;
+	gdev->debug.encoded++;
+	gxmicro_hist_add(&gdev->debug.encode, encode_ns);
+
+	resized = gxmicro_source_check(gdev);
+	if (resized)
+		gxmicro_buf_evict(gdev);
+
 	gbuf = list_first_entry_or_null(&gdev->buffers, struct gxmicro_buffer, list);
-	if (gbuf && !list_is_last(&gbuf->list, &gdev->buffers))
-		ret = IRQ_WAKE_THREAD;
+	if (!gbuf || (list_is_last(&gbuf->list, &gdev->buffers) && !gdev->low_latency)) {
+		gdev->busy = false;	/* 保留最后一个 buffer, 由 gxmicro_buf_queue() 重新启动 */
+		goto irq_handler;
+	}
+
+	/* EOF 时间, 用于比较各模式下 timestamp 到 DQBUF 的延迟 */
+	gbuf->vbuf.vb2_buf.timestamp = ktime_get_ns();
+	gbuf->overflow = status & JPEG_BS_OVERFLOW;
+	gbuf->resized = resized;
+	if (gbuf->overflow) {
+		gdev->stats.overflows++;
+		gdev->debug.overflows++;
+		dev_dbg(gdev->dev, "overflow: JPEG_BS_LEN_MAX %u qp %u retries %u\n",
+			gbuf->size, gbuf->qp, gbuf->retries);
+
+		/* 同一帧以更大的 QP 重新编码, 超过次数后以 VB2_BUF_STATE_ERROR 返回 */
+		if (!resized && gbuf->retries < READ_ONCE(overflow_retries) && gbuf->qp < JPEG_QP_MAX) {
+			gbuf->retries++;
+			gbuf->qp = min_t(uint32_t, gbuf->qp * 2, JPEG_QP_MAX);
+			gdev->stats.retries++;
+			gxmicro_jpeg_start(gdev);
+			goto irq_handler;
+		}
+	}
+
+	gxmicro_buf_length(gdev, gbuf, gxmicro_read(gdev, JPEG_BS_LENGTH));
+	gxmicro_rc_update(gdev, gbuf->fsize);
+
+	/* 丢弃的帧也占用序号, 用户可根据 sequence 不连续发现丢帧; irq thread 完成的帧在重复帧检测后输出元数据 */
+	gbuf->vbuf.sequence = gdev->sequence++;
+	gxmicro_meta_done(gdev, gbuf->vbuf.sequence, gbuf->qp, gbuf->retries, gbuf->overflow, encode_ns,
+			  !gdev->low_latency && !hardirq);
+
+	/* Low latency: 在硬中断中完成, 不保留最后一个 buffer, 编码器持续运行 */
+	if (gdev->low_latency) {
+		list_del(&gbuf->list);
+		gdev->busy = false;
+		gxmicro_buf_latest(gdev, gbuf);
+		if (!gdev->busy && !list_empty(&gdev->buffers))
+			gxmicro_jpeg_kick(gdev);
+		goto irq_handler;
+	}
 
+	if (hardirq) {
+		list_del(&gbuf->list);
+		gxmicro_buf_done(gdev, gbuf);
+		gxmicro_jpeg_kick(gdev);
+		goto irq_handler;
+	}
+
+	/* Pipeline: 下一个 buffer 地址已在 buf_queue 中准备好, 立即启动下一帧编码 */
+	if (pipeline) {
+		list_move_tail(&gbuf->list, &gdev->done);
+		gxmicro_jpeg_kick(gdev);
+	}
+
+	ret = IRQ_WAKE_THREAD;
+
+irq_handler:
+	/* 实时采集空闲, 执行等待的 m2m job 或快照 */
+	gxmicro_engine_next(gdev);
 	spin_unlock(&gdev->buf_lock);
 
 	return ret;
@@ -220,30 +1264,55 @@ static irqreturn_t gxmicro_irq_thread(int irq, void *arg)
 {
 	struct gxmicro_jpeg_dev *gdev = arg;
 	struct gxmicro_buffer *gbuf;
+	enum gxmicro_frame_kind frame;
 	irqreturn_t ret = IRQ_NONE;
-	uint32_t fsize;
+	unsigned long flags;
 
-	fsize = gxmicro_read(gdev, JPEG_BS_LENGTH);
+	/* pace 定时器在硬中断中获取 buf_lock */
+	if (pipeline) {
+		spin_lock_irqsave(&gdev->buf_lock, flags);
+		while ((gbuf = list_first_entry_or_null(&gdev->done, struct gxmicro_buffer, list))) {
+			/* 计算码流哈希与复制时不持有 buf_lock, 硬中断只在 done 尾部添加 */
+			spin_unlock_irqrestore(&gdev->buf_lock, flags);
+			frame = gxmicro_buf_inspect(gdev, gbuf);
+			spin_lock_irqsave(&gdev->buf_lock, flags);
+
+			/* stop_streaming */
+			if (gbuf != list_first_entry_or_null(&gdev->done, struct gxmicro_buffer, list))
+				break;
+
+			list_del(&gbuf->list);
+			gxmicro_buf_emit(gdev, gbuf, frame);
+			ret = IRQ_HANDLED;
+		}
+		spin_unlock_irqrestore(&gdev->buf_lock, flags);
 
-	spin_lock(&gdev->buf_lock);
+		return ret;
+	}
+
+	spin_lock_irqsave(&gdev->buf_lock, flags);
 
 	gbuf = list_first_entry_or_null(&gdev->buffers, struct gxmicro_buffer, list);
 	if (!gbuf || list_is_last(&gbuf->list, &gdev->buffers))
 		goto irq_thread;
 
-	vb2_set_plane_payload(&gbuf->vbuf.vb2_buf, 0, fsize);
-	gbuf->vbuf.vb2_buf.timestamp = ktime_get_ns();
-	gbuf->vbuf.sequence = gdev->sequence++;
-	gbuf->vbuf.field = V4L2_FIELD_NONE;
-	vb2_buffer_done(&gbuf->vbuf.vb2_buf, VB2_BUF_STATE_DONE);
+	/* 编码器在 gxmicro_jpeg_kick() 前空闲, gbuf 只会被 stop_streaming 移除, fsize 已在硬中断中读取 */
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+	frame = gxmicro_buf_inspect(gdev, gbuf);
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	if (gbuf != list_first_entry_or_null(&gdev->buffers, struct gxmicro_buffer, list))
+		goto irq_thread;
+
 	list_del(&gbuf->list);
+	gxmicro_buf_emit(gdev, gbuf, frame);
 
-	gxmicro_jpeg_start(gdev);
+	gxmicro_jpeg_kick(gdev);
 
 	ret = IRQ_HANDLED;
 
 irq_thread:
-	spin_unlock(&gdev->buf_lock);
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
 
 	return ret;
 }
@@ -253,14 +1322,16 @@ static int gxmicro_irq_init(struct gxmicro_jpeg_dev *gdev)
 	int irq;
 	int ret;
 
-	irq = of_irq_get(gdev->dev->of_node, 0);
-	if (irq < 0) {
-		dev_err(gdev->dev, "IRQ not found\n");
+	irq = platform_get_irq(to_platform_device(gdev->dev), 0);	/* of 或模拟引擎的 IRQ resource */
+	if (irq < 0)
 		return irq;
-	}
+	gdev->irq = irq;
 
-	ret = devm_request_threaded_irq(gdev->dev, irq, gxmicro_irq_handler,
-					gxmicro_irq_thread, IRQF_ONESHOT, DRVNAME, gdev);
+	if (hardirq)
+		ret = devm_request_irq(gdev->dev, irq, gxmicro_irq_handler, 0, DRVNAME, gdev);
+	else
+		ret = devm_request_threaded_irq(gdev->dev, irq, gxmicro_irq_handler,
+						gxmicro_irq_thread, IRQF_ONESHOT, DRVNAME, gdev);
 	if (ret < 0) {
 		dev_err(gdev->dev, "Failed to request irq\n");
 		return ret;
@@ -280,6 +1351,11 @@ int gxmicro_vb2_init(struct gxmicro_jpeg_dev *gdev)
 {
 	int ret;
 
+	hrtimer_init(&gdev->pace, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	gdev->pace.function = gxmicro_pace_timer;
+	INIT_WORK(&gdev->start_work, gxmicro_start_work);
+	gxmicro_format_init(gdev);
+
 	ret = gxmicro_vbq_init(gdev);
 	if (ret)
 		goto err_vbq_init;
@@ -288,6 +1364,8 @@ int gxmicro_vb2_init(struct gxmicro_jpeg_dev *gdev)
 	if (ret)
 		goto err_irq_init;
 
+	gxmicro_snap_init(gdev);
+
 	return 0;
 
 err_irq_init:
@@ -298,6 +1376,8 @@ err_vbq_init:
 
 void gxmicro_vb2_fini(struct gxmicro_jpeg_dev *gdev)
 {
+	gxmicro_snap_fini(gdev);
+
 	gxmicro_irq_fini(gdev);
 
 	gxmicro_vbq_fini(gdev);
@@ -7,7 +7,11 @@
  * Author:
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <media/videobuf2-v4l2.h>
+#include <media/v4l2-event.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-dv-timings.h>
 
@@ -20,22 +24,50 @@
 
 static void gxmicro_jpeg_on(struct gxmicro_jpeg_dev *gdev)
 {
+	unsigned long flags;
 	uint32_t jconf;
 
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	/* m2m job 或快照执行中, 修改完成后恢复的 JPEG_CONF */
+	if (gdev->m2m.active) {
+		gdev->m2m.jconf |= JPEG_INTR_ENABLE;
+		goto jpeg_on;
+	}
+	if (gdev->snap.active) {
+		gdev->snap.jconf |= JPEG_INTR_ENABLE;
+		goto jpeg_on;
+	}
+
 	jconf = gxmicro_read(gdev, JPEG_CONF);
 	jconf |= JPEG_INTR_ENABLE;
 
 	gxmicro_write(gdev, JPEG_CONF, jconf);
 	gxmicro_write(gdev, JPEG_INTR, JPEG_INTR_MASK);
-	gxmicro_write(gdev, JPEG_BS_LEN_MAX, JPEG_MAX_BS);
+	/* JPEG_BS_LEN_MAX: 每个 buffer 在 gxmicro_jpeg_start() 中按 plane size 设置 */
+
+jpeg_on:
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
 
 	/* Reserved: clk, dma */
 }
 
 static void gxmicro_jpeg_off(struct gxmicro_jpeg_dev *gdev)
 {
+	unsigned long flags;
 	uint32_t jconf;
 
+	spin_lock_irqsave(&gdev->buf_lock, flags);
+
+	if (gdev->m2m.active) {
+		gdev->m2m.jconf &= ~JPEG_INTR_ENABLE;
+		goto jpeg_off;
+	}
+	if (gdev->snap.active) {
+		gdev->snap.jconf &= ~JPEG_INTR_ENABLE;
+		goto jpeg_off;
+	}
+
 	jconf = gxmicro_read(gdev, JPEG_CONF);
 	jconf &= ~JPEG_INTR_ENABLE;
 
@@ -43,26 +75,35 @@ static void gxmicro_jpeg_off(struct gxmicro_jpeg_dev *gdev)
 	gxmicro_write(gdev, JPEG_INTR, JPEG_INTR_MASK);
 	gxmicro_write(gdev, JPEG_BS_LEN_MAX, JPEG_MIN_BS);
 
+jpeg_off:
+	spin_unlock_irqrestore(&gdev->buf_lock, flags);
+
 	/* Reserved: clk, dma */
 }
 
 static int gxmicro_jpeg_open(struct file *file)
 {
 	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
-	int ret = 0;
+	struct gxmicro_fh *gfh;
+
+	/* 代替 v4l2_fh_open(), 附加 reader */
+	gfh = kzalloc(sizeof(*gfh), GFP_KERNEL);
+	if (!gfh)
+		return -ENOMEM;
 
 	mutex_lock(&gdev->vlock);
 
-	ret = v4l2_fh_open(file);
-	if (ret)
-		goto jpeg_open;
+	v4l2_fh_init(&gfh->fh, &gdev->vdev);
+	file->private_data = &gfh->fh;
+	v4l2_fh_add(&gfh->fh);
 
-	if (v4l2_fh_is_singular_file(file))
+	if (v4l2_fh_is_singular_file(file)) {
+		gxmicro_format_refresh(gdev);
 		gxmicro_jpeg_on(gdev);
+	}
 
-jpeg_open:
 	mutex_unlock(&gdev->vlock);
-	return ret;
+	return 0;
 }
 
 static int gxmicro_jpeg_release(struct file *file)
@@ -75,6 +116,8 @@ static int gxmicro_jpeg_release(struct file *file)
 	if (v4l2_fh_is_singular_file(file))
 		gxmicro_jpeg_off(gdev);
 
+	gxmicro_reader_detach(gdev, fh_to_gxmicro_fh(file->private_data));
+
 	ret = _vb2_fop_release(file, NULL);
 
 	mutex_unlock(&gdev->vlock);
@@ -82,11 +125,101 @@ static int gxmicro_jpeg_release(struct file *file)
 	return ret;
 }
 
+/* 设置了 reader 的 file handle 从分发队列取帧, 否则使用 vb2 队列 */
+static ssize_t gxmicro_jpeg_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct gxmicro_reader *reader = fh_to_gxmicro_fh(file->private_data)->reader;
+
+	if (reader)
+		return gxmicro_reader_read(gdev, reader, buf, count, file->f_flags & O_NONBLOCK);
+
+	return vb2_fop_read(file, buf, count, ppos);
+}
+
+static __poll_t gxmicro_jpeg_poll(struct file *file, poll_table *wait)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct v4l2_fh *fh = file->private_data;
+	struct gxmicro_reader *reader = fh_to_gxmicro_fh(fh)->reader;
+	__poll_t res;
+
+	if (!reader)
+		return vb2_fop_poll(file, wait);	/* 包括 EPOLLPRI */
+
+	/* 与 vb2_fop_poll() 相同, 订阅的事件以 EPOLLPRI 通知 */
+	res = gxmicro_reader_poll(gdev, reader, file, wait);
+	poll_wait(file, &fh->wait, wait);
+	if (v4l2_event_pending(fh))
+		res |= EPOLLPRI;
+
+	return res;
+}
+
+/* ****************************** Readers, Snapshot ****************************** */
+
+/* attach 需要 vlock, 与 release 中的 detach 互斥 */
+static long gxmicro_jpeg_s_reader(struct file *file, void __user *arg)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct gxmicro_reader_cfg cfg;
+	long ret;
+
+	if (copy_from_user(&cfg, arg, sizeof(cfg)))
+		return -EFAULT;
+
+	if (mutex_lock_interruptible(&gdev->vlock))
+		return -ERESTARTSYS;
+	ret = gxmicro_reader_attach(gdev, fh_to_gxmicro_fh(file->private_data), &cfg);
+	mutex_unlock(&gdev->vlock);
+
+	return ret;
+}
+
+/* 可能阻塞等待编码, 不持有 vlock; reader 只在 release 时释放, ioctl 期间不会释放 */
+static long gxmicro_jpeg_g_frame(struct file *file, unsigned int cmd, void __user *arg)
+{
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct gxmicro_reader *reader = READ_ONCE(fh_to_gxmicro_fh(file->private_data)->reader);
+	struct gxmicro_frame_info info;
+	long ret;
+
+	if (copy_from_user(&info, arg, sizeof(info)))
+		return -EFAULT;
+
+	if (cmd == VIDIOC_GXMICRO_G_SNAPSHOT)
+		ret = gxmicro_fanout_snapshot(gdev, &info);
+	else if (reader)
+		ret = gxmicro_reader_dqframe(gdev, reader, &info, file->f_flags & O_NONBLOCK);
+	else
+		ret = -EINVAL;
+
+	/* -ENOSPC 时也返回 bytesused, 用户据此增大 buffer */
+	if ((!ret || ret == -ENOSPC) && copy_to_user(arg, &info, sizeof(info)))
+		return -EFAULT;
+
+	return ret;
+}
+
+/* 私有 ioctl 在 video_ioctl2() 之前处理, 不经过 vdev->lock */
+static long gxmicro_jpeg_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case VIDIOC_GXMICRO_S_READER:
+		return gxmicro_jpeg_s_reader(file, (void __user *)arg);
+	case VIDIOC_GXMICRO_G_SNAPSHOT:
+	case VIDIOC_GXMICRO_DQFRAME:
+		return gxmicro_jpeg_g_frame(file, cmd, (void __user *)arg);
+	default:
+		return video_ioctl2(file, cmd, arg);
+	}
+}
+
 static const struct v4l2_file_operations gxmicro_v4l2_fops = {
 	.owner = THIS_MODULE,
-	.read = vb2_fop_read,
-	.poll = vb2_fop_poll,
-	.unlocked_ioctl = video_ioctl2,
+	.read = gxmicro_jpeg_read,
+	.poll = gxmicro_jpeg_poll,
+	.unlocked_ioctl = gxmicro_jpeg_ioctl,
 	.mmap = vb2_fop_mmap,
 	.open = gxmicro_jpeg_open,
 	.release = gxmicro_jpeg_release,
@@ -118,33 +251,17 @@ static int gxmicro_vidioc_enum_fmt(struct file *file, void *fh, struct v4l2_fmtd
 static int gxmicro_vidioc_g_fmt_vid_cap(struct file *file, void *fh, struct v4l2_format *f)
 {
 	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
-	uint32_t jconf, width, height;
-	uint8_t bpp;
-	uint32_t bpl, sizeimage;
+	struct gxmicro_format fmt;
 
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
-	jconf = gxmicro_read(gdev, JPEG_CONF);
-
-	switch (jconf & JPEG_ENC_FORMAT_MASK) {
-	case JPEG_ENC_RBG565:
-	case JPEG_ENC_YUV422:
-		bpp = JPEG_16BPP;
-		break;
-	case JPEG_ENC_XRGB888:
-		bpp = JPEG_32BPP;
-		break;
-	}
+	gxmicro_format_poll(gdev);
+	gxmicro_format_get(gdev, &fmt);
 
-	bpl = JPEG_BPL(width, bpp);
-	sizeimage = JPEG_SZ(height, bpl);
-
-	f->fmt.pix.width = width;
-	f->fmt.pix.height = height;
+	f->fmt.pix.width = fmt.width;
+	f->fmt.pix.height = fmt.height;
 	f->fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
 	f->fmt.pix.field = V4L2_FIELD_NONE;
-	f->fmt.pix.bytesperline = bpl;
-	f->fmt.pix.sizeimage = sizeimage;
+	f->fmt.pix.bytesperline = fmt.bpl;
+	f->fmt.pix.sizeimage = fmt.sizeimage;
 	f->fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
 	f->fmt.pix.flags = 0;		/* videodev2.h, line: 1667, JPEG: always power on */
 	f->fmt.pix.ycbcr_enc = V4L2_YCBCR_ENC_601;
@@ -191,33 +308,52 @@ static int gxmicro_vidioc_s_input(struct file *file, void *fh, unsigned int inpu
 
 static int gxmicro_vidioc_g_parm(struct file *file, void *fh, struct v4l2_streamparm *sp)
 {
-	sp->parm.capture.capability = 0;
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+
+	sp->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
 	sp->parm.capture.readbuffers = JPEG_BUFFERS;
-	sp->parm.capture.timeperframe.numerator = 1;
-	sp->parm.capture.timeperframe.denominator = JPEG_RATE;
+	sp->parm.capture.timeperframe = gdev->timeperframe;
 
 	return 0;
 }
 
 static int gxmicro_vidioc_s_parm(struct file *file, void *fh, struct v4l2_streamparm *sp)
 {
-	return 0;
+	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
+	struct v4l2_fract tpf = sp->parm.capture.timeperframe;
+
+	/* 限制在 1 / JPEG_MAX_RATE ~ 1 / JPEG_MIN_RATE s */
+	if (!tpf.numerator || !tpf.denominator) {
+		tpf.numerator = 1;
+		tpf.denominator = JPEG_RATE;
+	} else if ((uint64_t)tpf.numerator * JPEG_MAX_RATE < tpf.denominator) {
+		tpf.numerator = 1;
+		tpf.denominator = JPEG_MAX_RATE;
+	} else if ((uint64_t)tpf.numerator * JPEG_MIN_RATE > tpf.denominator) {
+		tpf.numerator = 1;
+		tpf.denominator = JPEG_MIN_RATE;
+	}
+
+	gdev->timeperframe = tpf;
+	/* 下一帧开始生效 */
+	WRITE_ONCE(gdev->interval, div_u64((uint64_t)tpf.numerator * NSEC_PER_SEC, tpf.denominator));
+
+	return gxmicro_vidioc_g_parm(file, fh, sp);
 }
 
 static int gxmicro_vidioc_enum_framesizes(struct file *file, void *fh, struct v4l2_frmsizeenum *fsize)
 {
 	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
-	uint32_t width, height;
+	struct gxmicro_format fmt;
 
 	if (fsize->index || (fsize->pixel_format != V4L2_PIX_FMT_JPEG))
 		return -EINVAL;
 
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
+	gxmicro_format_get(gdev, &fmt);
 
 	fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
-	fsize->discrete.width = width;
-	fsize->discrete.height = height;
+	fsize->discrete.width = fmt.width;
+	fsize->discrete.height = fmt.height;
 
 	return 0;
 }
@@ -225,20 +361,23 @@ static int gxmicro_vidioc_enum_framesizes(struct file *file, void *fh, struct v4
 static int gxmicro_vidioc_enum_frameintervals(struct file *file, void *fh, struct v4l2_frmivalenum *fival)
 {
 	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
-	uint32_t width, height;
+	struct gxmicro_format fmt;
 
 	if (fival->index || (fival->pixel_format != V4L2_PIX_FMT_JPEG))
 		return -EINVAL;
 
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
+	gxmicro_format_get(gdev, &fmt);
 
-	if (width != fival->width || height != fival->height)
+	if (fmt.width != fival->width || fmt.height != fival->height)
 		return -EINVAL;
 
-	fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;	/* 仅支持 30 HZ */
-	fival->discrete.denominator = JPEG_RATE;
-	fival->discrete.numerator = 1;	/* frame_interval [s] = 1 / 30, frame_rate = 1 / frame_interval */
+	fival->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;	/* frame_interval [s] = 1 / 60 ~ 1, frame_rate = 1 / frame_interval */
+	fival->stepwise.min.numerator = 1;
+	fival->stepwise.min.denominator = JPEG_MAX_RATE;
+	fival->stepwise.max.numerator = 1;
+	fival->stepwise.max.denominator = JPEG_MIN_RATE;
+	fival->stepwise.step.numerator = 1;
+	fival->stepwise.step.denominator = 1;
 
 	return 0;
 }
@@ -265,14 +404,13 @@ static int gxmicro_vidioc_s_dv_timings(struct file *file, void *fh, struct v4l2_
 static int gxmicro_vidioc_g_dv_timings(struct file *file, void *fh, struct v4l2_dv_timings *timings)
 {
 	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
-	uint32_t width, height;
+	struct gxmicro_format fmt;
 
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
+	gxmicro_format_get(gdev, &fmt);
 
 	timings->type = V4L2_DV_BT_656_1120;
-	timings->bt.width = width;
-	timings->bt.height = height;
+	timings->bt.width = fmt.width;
+	timings->bt.height = fmt.height;
 
 	return 0;
 }
@@ -280,14 +418,14 @@ static int gxmicro_vidioc_g_dv_timings(struct file *file, void *fh, struct v4l2_
 static int gxmicro_vidioc_query_dv_timings(struct file *file, void *fh, struct v4l2_dv_timings *timings)
 {
 	struct gxmicro_jpeg_dev *gdev = video_drvdata(file);
-	uint32_t width, height;
+	struct gxmicro_format fmt;
 
-	width = gxmicro_read(gdev, JPEG_WIDTH);
-	height = gxmicro_read(gdev, JPEG_HEIGHT);
+	gxmicro_format_poll(gdev);
+	gxmicro_format_get(gdev, &fmt);
 
 	timings->type = V4L2_DV_BT_656_1120;
-	timings->bt.width = width;
-	timings->bt.height = height;
+	timings->bt.width = fmt.width;
+	timings->bt.height = fmt.height;
 
 	return 0;
 }
@@ -304,6 +442,17 @@ static int gxmicro_vidioc_dv_timings_cap(struct file *file, void *fh, struct v4l
 	return 0;
 }
 
+/* V4L2_EVENT_SOURCE_CHANGE: 源分辨率变化, see gxmicro_source_check() */
+static int gxmicro_vidioc_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subscribe(fh, sub);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
 static const struct v4l2_ioctl_ops gxmicro_v4l2_ioctl_ops = {
 
 	/* VIDIOC */
@@ -333,7 +482,7 @@ static const struct v4l2_ioctl_ops gxmicro_v4l2_ioctl_ops = {
 
 	/* Stream type-dependent parameter */
 	.vidioc_g_parm = gxmicro_vidioc_g_parm,
-	.vidioc_s_parm = gxmicro_vidioc_s_parm,	/* 仅支持 30 HZ */
+	.vidioc_s_parm = gxmicro_vidioc_s_parm,	/* 1 ~ 60 HZ, hrtimer 控制编码启动间隔 */
 
 	/* Log status */
 	.vidioc_log_status = v4l2_ctrl_log_status,
@@ -349,6 +498,10 @@ static const struct v4l2_ioctl_ops gxmicro_v4l2_ioctl_ops = {
 	.vidioc_query_dv_timings = gxmicro_vidioc_query_dv_timings,
 	.vidioc_enum_dv_timings = gxmicro_vidioc_enum_dv_timings,
 	.vidioc_dv_timings_cap = gxmicro_vidioc_dv_timings_cap,
+
+	/* Event */
+	.vidioc_subscribe_event = gxmicro_vidioc_subscribe_event,
+	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
 };
 
 /* ****************************** Video Init & Fini ****************************** */
@@ -358,6 +511,10 @@ int gxmicro_video_init(struct gxmicro_jpeg_dev *gdev)
 	struct video_device *vdev = &gdev->vdev;
 	int ret;
 
+	gdev->timeperframe.numerator = 1;
+	gdev->timeperframe.denominator = JPEG_RATE;
+	gdev->interval = NSEC_PER_SEC / JPEG_RATE;
+
 	vdev->fops = &gxmicro_v4l2_fops;
 	vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_READWRITE | V4L2_CAP_STREAMING;
 	vdev->v4l2_dev = &gdev->v4l2;
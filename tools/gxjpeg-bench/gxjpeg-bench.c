@@ -0,0 +1,643 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * GXMicro JPEG capture benchmark
+ *
+ * Copyright (C) 2022 GXMicro (ShangHai) Corp.
+ *
+ * 以 MMAP, read() 或 DMABUF (dma-heap 分配) 方式 STREAMON 指定时间, 统计:
+ * 	帧率, 每帧码流大小, DQBUF 间隔 (p50 / p99 / max), buffer timestamp (EOF) 到 DQBUF 的延迟.
+ * 驱动与模拟引擎 (gxmicro_jpeg_emu.ko) 相同使用.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-heap.h>
+
+#include "gxmicro_uapi.h"
+
+#define BENCH_BUFFERS_MAX	VIDEO_MAX_FRAME
+#define BENCH_POLL_MS		1000
+
+enum bench_io {
+	BENCH_IO_MMAP,
+	BENCH_IO_READ,
+	BENCH_IO_DMABUF,
+};
+
+static const char * const bench_io_name[] = {
+	[BENCH_IO_MMAP] = "mmap",
+	[BENCH_IO_READ] = "read",
+	[BENCH_IO_DMABUF] = "dmabuf",
+};
+
+struct bench_buf {
+	void *addr;
+	size_t size;
+	int fd;		/* DMABUF */
+};
+
+/* 样本, 结束后排序取百分位 */
+struct bench_samples {
+	uint64_t *val;
+	size_t count, alloc;
+};
+
+struct bench {
+	const char *dev;
+	const char *heap;
+	enum bench_io io;
+	unsigned int seconds;
+	unsigned int nbuffers;
+	int qp;			/* V4L2_CID_JPEG_COMPRESSION_QUALITY, 0: 不修改 */
+	int subsampling;	/* V4L2_CID_JPEG_CHROMA_SUBSAMPLING, -1: 不修改 */
+	unsigned int fps;	/* VIDIOC_S_PARM, 0: 不修改 */
+	bool json;
+
+	int fd;
+	char card[32];
+	struct v4l2_pix_format pix;
+	struct bench_buf bufs[BENCH_BUFFERS_MAX];
+	unsigned int count;
+
+	/* 结果 */
+	uint64_t frames, errors, gaps;
+	uint32_t sequence;
+	uint64_t bytes, bytes_min, bytes_max;
+	uint64_t elapsed_ns;
+	struct bench_samples d2d;	/* DQBUF 间隔 */
+	struct bench_samples latency;	/* timestamp -> DQBUF, read() 无 timestamp */
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_ioctl(int fd, unsigned long req, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, req, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static void bench_sample_add(struct bench_samples *s, uint64_t val)
+{
+	uint64_t *tmp;
+
+	if (s->count == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 1024;
+		tmp = realloc(s->val, s->alloc * sizeof(*tmp));
+		if (!tmp) {
+			s->alloc = s->count;	/* 内存不足时丢弃样本 */
+			return;
+		}
+		s->val = tmp;
+	}
+
+	s->val[s->count++] = val;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* 已排序, nearest-rank */
+static uint64_t bench_percentile(const struct bench_samples *s, unsigned int pct)
+{
+	size_t rank;
+
+	if (!s->count)
+		return 0;
+
+	rank = (s->count * pct + 99) / 100;
+	return s->val[rank ? rank - 1 : 0];
+}
+
+/* ****************************** Setup ****************************** */
+
+static int bench_set_ctrl(struct bench *b, uint32_t id, int32_t val, const char *name)
+{
+	struct v4l2_control ctrl = { .id = id, .value = val };
+
+	if (bench_ioctl(b->fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+		fprintf(stderr, "%s: failed to set %s: %s\n", b->dev, name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_setup(struct bench *b)
+{
+	struct v4l2_capability cap;
+	struct v4l2_format fmt;
+	struct v4l2_streamparm parm;
+	uint32_t need;
+
+	b->fd = open(b->dev, O_RDWR | O_NONBLOCK);
+	if (b->fd < 0) {
+		fprintf(stderr, "%s: %s\n", b->dev, strerror(errno));
+		return -1;
+	}
+
+	memset(&cap, 0, sizeof(cap));
+	if (bench_ioctl(b->fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		fprintf(stderr, "%s: VIDIOC_QUERYCAP: %s\n", b->dev, strerror(errno));
+		return -1;
+	}
+	snprintf(b->card, sizeof(b->card), "%s", (const char *)cap.card);
+
+	need = b->io == BENCH_IO_READ ? V4L2_CAP_READWRITE : V4L2_CAP_STREAMING;
+	if (!(cap.device_caps & V4L2_CAP_VIDEO_CAPTURE) || !(cap.device_caps & need)) {
+		fprintf(stderr, "%s: %s capture not supported\n", b->dev, bench_io_name[b->io]);
+		return -1;
+	}
+
+	if (b->qp && bench_set_ctrl(b, V4L2_CID_JPEG_COMPRESSION_QUALITY, b->qp, "QP"))
+		return -1;
+
+	if (b->subsampling >= 0 &&
+	    bench_set_ctrl(b, V4L2_CID_JPEG_CHROMA_SUBSAMPLING, b->subsampling, "subsampling"))
+		return -1;
+
+	if (b->fps) {
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		parm.parm.capture.timeperframe.numerator = 1;
+		parm.parm.capture.timeperframe.denominator = b->fps;
+		if (bench_ioctl(b->fd, VIDIOC_S_PARM, &parm) < 0) {
+			fprintf(stderr, "%s: VIDIOC_S_PARM: %s\n", b->dev, strerror(errno));
+			return -1;
+		}
+	}
+
+	/* QP 与 subsampling 修改后 sizeimage 随之变化 */
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (bench_ioctl(b->fd, VIDIOC_G_FMT, &fmt) < 0) {
+		fprintf(stderr, "%s: VIDIOC_G_FMT: %s\n", b->dev, strerror(errno));
+		return -1;
+	}
+	b->pix = fmt.fmt.pix;
+
+	return 0;
+}
+
+static int bench_dmabuf_alloc(struct bench *b, struct bench_buf *buf, size_t size)
+{
+	struct dma_heap_allocation_data data = {
+		.len = size,
+		.fd_flags = O_RDWR | O_CLOEXEC,
+	};
+	int heap, ret;
+
+	heap = open(b->heap, O_RDONLY | O_CLOEXEC);
+	if (heap < 0) {
+		fprintf(stderr, "%s: %s\n", b->heap, strerror(errno));
+		return -1;
+	}
+
+	ret = bench_ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &data);
+	close(heap);
+	if (ret < 0) {
+		fprintf(stderr, "%s: DMA_HEAP_IOCTL_ALLOC: %s\n", b->heap, strerror(errno));
+		return -1;
+	}
+
+	buf->fd = data.fd;
+	buf->size = size;
+
+	return 0;
+}
+
+static int bench_qbuf(struct bench *b, unsigned int index)
+{
+	struct v4l2_buffer vbuf;
+
+	memset(&vbuf, 0, sizeof(vbuf));
+	vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	vbuf.index = index;
+	if (b->io == BENCH_IO_DMABUF) {
+		vbuf.memory = V4L2_MEMORY_DMABUF;
+		vbuf.m.fd = b->bufs[index].fd;
+		vbuf.length = b->bufs[index].size;
+	} else {
+		vbuf.memory = V4L2_MEMORY_MMAP;
+	}
+
+	if (bench_ioctl(b->fd, VIDIOC_QBUF, &vbuf) < 0) {
+		fprintf(stderr, "%s: VIDIOC_QBUF: %s\n", b->dev, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_buffers_init(struct bench *b)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer vbuf;
+	unsigned int i;
+
+	if (b->io == BENCH_IO_READ) {
+		/* 每次 read() 返回一帧, buffer 不小于 sizeimage */
+		b->bufs[0].size = b->pix.sizeimage;
+		b->bufs[0].addr = malloc(b->bufs[0].size);
+		if (!b->bufs[0].addr)
+			return -1;
+		b->count = 1;
+		return 0;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = b->io == BENCH_IO_DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+	req.count = b->nbuffers;
+	if (bench_ioctl(b->fd, VIDIOC_REQBUFS, &req) < 0) {
+		fprintf(stderr, "%s: VIDIOC_REQBUFS: %s\n", b->dev, strerror(errno));
+		return -1;
+	}
+	b->count = req.count < BENCH_BUFFERS_MAX ? req.count : BENCH_BUFFERS_MAX;
+	for (i = 0; i < b->count; i++)
+		b->bufs[i].fd = -1;
+
+	for (i = 0; i < b->count; i++) {
+		if (b->io == BENCH_IO_DMABUF) {
+			/* 驱动要求 DMA 连续, 使用 CMA 或 reserved-memory heap */
+			if (bench_dmabuf_alloc(b, &b->bufs[i], b->pix.sizeimage))
+				return -1;
+			continue;
+		}
+
+		memset(&vbuf, 0, sizeof(vbuf));
+		vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		vbuf.memory = V4L2_MEMORY_MMAP;
+		vbuf.index = i;
+		if (bench_ioctl(b->fd, VIDIOC_QUERYBUF, &vbuf) < 0) {
+			fprintf(stderr, "%s: VIDIOC_QUERYBUF: %s\n", b->dev, strerror(errno));
+			return -1;
+		}
+
+		b->bufs[i].size = vbuf.length;
+		b->bufs[i].addr = mmap(NULL, vbuf.length, PROT_READ, MAP_SHARED, b->fd, vbuf.m.offset);
+		if (b->bufs[i].addr == MAP_FAILED) {
+			b->bufs[i].addr = NULL;
+			fprintf(stderr, "%s: mmap: %s\n", b->dev, strerror(errno));
+			return -1;
+		}
+	}
+
+	for (i = 0; i < b->count; i++)
+		if (bench_qbuf(b, i))
+			return -1;
+
+	return 0;
+}
+
+static void bench_buffers_fini(struct bench *b)
+{
+	struct v4l2_requestbuffers req;
+	unsigned int i;
+
+	if (b->io == BENCH_IO_READ) {
+		free(b->bufs[0].addr);
+		return;
+	}
+
+	for (i = 0; i < b->count; i++) {
+		if (b->bufs[i].addr)
+			munmap(b->bufs[i].addr, b->bufs[i].size);
+		if (b->bufs[i].fd >= 0)
+			close(b->bufs[i].fd);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = b->io == BENCH_IO_DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+	bench_ioctl(b->fd, VIDIOC_REQBUFS, &req);
+}
+
+/* ****************************** Capture ****************************** */
+
+static void bench_frame(struct bench *b, uint64_t now, uint64_t *last, uint32_t bytes,
+			bool error, const struct v4l2_buffer *vbuf)
+{
+	uint64_t ts;
+
+	if (*last)
+		bench_sample_add(&b->d2d, now - *last);
+	*last = now;
+
+	if (error) {
+		b->errors++;
+		return;
+	}
+
+	b->frames++;
+	b->bytes += bytes;
+	if (!b->bytes_min || bytes < b->bytes_min)
+		b->bytes_min = bytes;
+	if (bytes > b->bytes_max)
+		b->bytes_max = bytes;
+
+	if (!vbuf)
+		return;
+
+	/* low latency, 重复帧丢弃时 sequence 不连续 */
+	if (b->frames > 1 && vbuf->sequence > b->sequence + 1)
+		b->gaps += vbuf->sequence - b->sequence - 1;
+	b->sequence = vbuf->sequence;
+
+	/* V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC: EOF 硬中断时间 */
+	ts = (uint64_t)vbuf->timestamp.tv_sec * 1000000000ULL + vbuf->timestamp.tv_usec * 1000ULL;
+	if (ts && ts <= now)
+		bench_sample_add(&b->latency, now - ts);
+}
+
+static int bench_wait(struct bench *b)
+{
+	struct pollfd pfd = { .fd = b->fd, .events = POLLIN };
+	int ret;
+
+	ret = poll(&pfd, 1, BENCH_POLL_MS);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	if (!ret) {
+		fprintf(stderr, "%s: no frame in %d ms\n", b->dev, BENCH_POLL_MS);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_run_read(struct bench *b, uint64_t end)
+{
+	uint64_t now, last = 0;
+	ssize_t len;
+
+	while (bench_now() < end) {
+		len = read(b->fd, b->bufs[0].addr, b->bufs[0].size);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (bench_wait(b))
+					return -1;
+				continue;
+			}
+			fprintf(stderr, "%s: read: %s\n", b->dev, strerror(errno));
+			return -1;
+		}
+
+		now = bench_now();
+		bench_frame(b, now, &last, len, !len, NULL);
+	}
+
+	return 0;
+}
+
+static int bench_run_stream(struct bench *b, uint64_t end)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct v4l2_buffer vbuf;
+	uint64_t now, last = 0;
+	int ret = 0;
+
+	if (bench_ioctl(b->fd, VIDIOC_STREAMON, &type) < 0) {
+		fprintf(stderr, "%s: VIDIOC_STREAMON: %s\n", b->dev, strerror(errno));
+		return -1;
+	}
+
+	while (bench_now() < end) {
+		memset(&vbuf, 0, sizeof(vbuf));
+		vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		vbuf.memory = b->io == BENCH_IO_DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+		if (bench_ioctl(b->fd, VIDIOC_DQBUF, &vbuf) < 0) {
+			if (errno == EAGAIN) {
+				ret = bench_wait(b);
+				if (ret)
+					break;
+				continue;
+			}
+			fprintf(stderr, "%s: VIDIOC_DQBUF: %s\n", b->dev, strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		now = bench_now();
+		bench_frame(b, now, &last, vbuf.bytesused, vbuf.flags & V4L2_BUF_FLAG_ERROR, &vbuf);
+
+		ret = bench_qbuf(b, vbuf.index);
+		if (ret)
+			break;
+	}
+
+	bench_ioctl(b->fd, VIDIOC_STREAMOFF, &type);
+
+	return ret;
+}
+
+static int bench_run(struct bench *b)
+{
+	uint64_t start;
+	int ret;
+
+	start = bench_now();
+	if (b->io == BENCH_IO_READ)
+		ret = bench_run_read(b, start + b->seconds * 1000000000ULL);
+	else
+		ret = bench_run_stream(b, start + b->seconds * 1000000000ULL);
+	b->elapsed_ns = bench_now() - start;
+
+	qsort(b->d2d.val, b->d2d.count, sizeof(uint64_t), bench_cmp);
+	qsort(b->latency.val, b->latency.count, sizeof(uint64_t), bench_cmp);
+
+	return ret;
+}
+
+/* ****************************** Report ****************************** */
+
+static const char *bench_subsampling_name(int subsampling)
+{
+	switch (subsampling) {
+	case V4L2_JPEG_CHROMA_SUBSAMPLING_444:
+		return "444";
+	case V4L2_JPEG_CHROMA_SUBSAMPLING_420:
+		return "420";
+	default:
+		return "default";
+	}
+}
+
+static void bench_report(const struct bench *b)
+{
+	double secs = b->elapsed_ns / 1e9;
+	double fps = secs > 0 ? b->frames / secs : 0;
+	uint64_t avg = b->frames ? b->bytes / b->frames : 0;
+
+	if (b->json) {
+		printf("{\"device\":\"%s\",\"card\":\"%s\",\"io\":\"%s\",\"buffers\":%u,", b->dev, b->card,
+		       bench_io_name[b->io], b->count);
+		printf("\"width\":%u,\"height\":%u,\"sizeimage\":%u,\"qp\":%d,\"subsampling\":\"%s\",",
+		       b->pix.width, b->pix.height, b->pix.sizeimage, b->qp, bench_subsampling_name(b->subsampling));
+		printf("\"seconds\":%.3f,\"frames\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"gaps\":%" PRIu64 ",\"fps\":%.2f,",
+		       secs, b->frames, b->errors, b->gaps, fps);
+		printf("\"bytes\":{\"avg\":%" PRIu64 ",\"min\":%" PRIu64 ",\"max\":%" PRIu64 "},",
+		       avg, b->bytes_min, b->bytes_max);
+		printf("\"d2d_us\":{\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 "},",
+		       bench_percentile(&b->d2d, 50) / 1000, bench_percentile(&b->d2d, 99) / 1000,
+		       bench_percentile(&b->d2d, 100) / 1000);
+		if (b->latency.count)
+			printf("\"latency_us\":{\"p50\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 "}}\n",
+			       bench_percentile(&b->latency, 50) / 1000, bench_percentile(&b->latency, 99) / 1000,
+			       bench_percentile(&b->latency, 100) / 1000);
+		else
+			printf("\"latency_us\":null}\n");
+		return;
+	}
+
+	printf("device:       %s (%s)\n", b->dev, b->card);
+	printf("io:           %s, %u buffers\n", bench_io_name[b->io], b->count);
+	printf("format:       %ux%u, sizeimage %u, qp %s%d, subsampling %s\n", b->pix.width, b->pix.height,
+	       b->pix.sizeimage, b->qp ? "" : "default ", b->qp, bench_subsampling_name(b->subsampling));
+	printf("duration:     %.3f s\n", secs);
+	printf("frames:       %" PRIu64 " (errors %" PRIu64 ", sequence gaps %" PRIu64 ")\n",
+	       b->frames, b->errors, b->gaps);
+	printf("fps:          %.2f\n", fps);
+	printf("bytes/frame:  avg %" PRIu64 ", min %" PRIu64 ", max %" PRIu64 "\n", avg, b->bytes_min, b->bytes_max);
+	printf("d2d (us):     p50 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\n",
+	       bench_percentile(&b->d2d, 50) / 1000, bench_percentile(&b->d2d, 99) / 1000,
+	       bench_percentile(&b->d2d, 100) / 1000);
+	if (b->latency.count)
+		printf("latency (us): p50 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\n",
+		       bench_percentile(&b->latency, 50) / 1000, bench_percentile(&b->latency, 99) / 1000,
+		       bench_percentile(&b->latency, 100) / 1000);
+	else
+		printf("latency (us): n/a (read)\n");
+}
+
+/* ****************************** Main ****************************** */
+
+static void bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -d <dev>      video device (default /dev/video0)\n"
+		"  -m <io>       mmap, read or dmabuf (default mmap)\n"
+		"  -t <seconds>  streaming time (default 10)\n"
+		"  -n <count>    buffer count for mmap / dmabuf (default 3)\n"
+		"  -q <qp>       V4L2_CID_JPEG_COMPRESSION_QUALITY, 1 ~ 2047\n"
+		"  -s <444|420>  chroma subsampling\n"
+		"  -r <fps>      frame rate, VIDIOC_S_PARM\n"
+		"  -H <heap>     dma-heap for dmabuf (default /dev/dma_heap/linux,cma)\n"
+		"  -j            print one JSON object\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = {
+		.dev = "/dev/video0",
+		.heap = "/dev/dma_heap/linux,cma",
+		.io = BENCH_IO_MMAP,
+		.seconds = 10,
+		.nbuffers = 3,
+		.subsampling = -1,
+		.fd = -1,
+	};
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:m:t:n:q:s:r:H:jh")) != -1) {
+		switch (opt) {
+		case 'd':
+			b.dev = optarg;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "mmap"))
+				b.io = BENCH_IO_MMAP;
+			else if (!strcmp(optarg, "read"))
+				b.io = BENCH_IO_READ;
+			else if (!strcmp(optarg, "dmabuf"))
+				b.io = BENCH_IO_DMABUF;
+			else
+				goto usage;
+			break;
+		case 't':
+			b.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.nbuffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			b.qp = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			if (!strcmp(optarg, "444"))
+				b.subsampling = V4L2_JPEG_CHROMA_SUBSAMPLING_444;
+			else if (!strcmp(optarg, "420"))
+				b.subsampling = V4L2_JPEG_CHROMA_SUBSAMPLING_420;
+			else
+				goto usage;
+			break;
+		case 'r':
+			b.fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			b.heap = optarg;
+			break;
+		case 'j':
+			b.json = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (!b.seconds || !b.nbuffers || b.nbuffers > BENCH_BUFFERS_MAX || b.qp < 0)
+		goto usage;
+
+	ret = bench_setup(&b);
+	if (ret)
+		goto err_setup;
+
+	ret = bench_buffers_init(&b);
+	if (ret)
+		goto err_buffers;
+
+	ret = bench_run(&b);
+	bench_report(&b);
+
+err_buffers:
+	bench_buffers_fini(&b);
+err_setup:
+	if (b.fd >= 0)
+		close(b.fd);
+	free(b.d2d.val);
+	free(b.latency.val);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	bench_usage(argv[0]);
+	return EXIT_FAILURE;
+}
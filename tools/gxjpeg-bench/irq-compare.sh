@@ -0,0 +1,30 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# 比较 hardirq=0 / hardirq=1 的出队延迟 (timestamp (EOF) 到 DQBUF).
+# 每种模式重新加载驱动, 以相同参数运行 gxjpeg-bench, 输出两行 JSON.
+#
+# 用法: irq-compare.sh [模块目录] [video 设备] [秒数] [emu]
+# 	第 4 个参数为 emu 时同时加载 gxmicro_jpeg_emu.ko (无 SoC), 否则使用真实硬件.
+
+set -e
+
+KO=${1:-.}
+DEV=${2:-/dev/video0}
+SECS=${3:-30}
+EMU=${4:-}
+BENCH=$(dirname "$0")/gxjpeg-bench
+
+for irq in 0 1; do
+	rmmod gxmicro_jpeg_emu 2>/dev/null || true
+	rmmod gxmicro_jpeg 2>/dev/null || true
+
+	insmod "$KO/gxmicro_jpeg.ko" hardirq=$irq
+	if [ "$EMU" = emu ]; then
+		insmod "$KO/gxmicro_jpeg_emu.ko" width=1920 height=1080 encode_us=10000 bs_size=262144
+	fi
+	sleep 1
+
+	printf 'hardirq=%s ' $irq
+	"$BENCH" -d "$DEV" -m mmap -t "$SECS" -n 4 -q 128 -s 420 -j
+done